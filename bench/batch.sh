@@ -0,0 +1,39 @@
+#!/bin/bash
+# Times batch mode and `vm-batch` against running `vm` once per input.  The
+# program iterates the logistic map ITERS times (20000 by default) from each
+# of N inputs (512 by default), each a starting point and a rate.  Then it
+# does the same for Collatz sequences, whose lengths differ from input to
+# input, so the lanes diverge.
+#
+# Usage: bench/batch.sh [vm binary] [N] [ITERS] [vm-batch binary]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+n=${2:-512}
+iters=${3:-20000}
+vm_batch=${4:-./vm-batch}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "Mr Mx $iters Mn L1 r x * 1 x - * Mx n 1- D Mn D? B1 ; x ' X" \
+  > "$dir/logistic.vm"
+echo "Mx 0 Mc L1 x 1.5 - ? x 2 % 0.5 - ? x 3 * 1 + Mx : x 2 / Mx ;" \
+  "c 1 + Mc B1 ; c ' X" > "$dir/collatz.vm"
+for ((i = 0; i < n; i++)); do
+  echo "0.$((RANDOM % 900 + 50)) 3.$((RANDOM % 500 + 500))"
+done > "$dir/logistic.in"
+for ((i = 0; i < n; i++)); do
+  echo "$((RANDOM * 32768 + RANDOM + 1))"
+done > "$dir/collatz.in"
+
+TIMEFORMAT='%3R s'
+for prog in logistic collatz; do
+  echo -n "$prog, batch mode: "
+  time "$vm" --batch "$dir/$prog.in" < "$dir/$prog.vm" > /dev/null
+  echo -n "$prog, vm-batch: "
+  time "$vm_batch" -i "$dir/$prog.in" "$dir/$prog.vm" > /dev/null 2>&1
+  echo -n "$prog, once per input: "
+  time while read -r input; do
+    { echo "$input"; cat "$dir/$prog.vm"; } | "$vm" > /dev/null
+  done < "$dir/$prog.in"
+done
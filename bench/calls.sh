@@ -0,0 +1,23 @@
+#!/bin/bash
+# Times a loop that calls two subroutines through variables, so each `C`
+# resolves its destination at run time, in a program with N global labels
+# (200 by default).  Pass `--caches` as the mode to also see the inline
+# caches' hit rates, or `--jit` to time the JIT.
+#
+# Usage: bench/calls.sh [vm binary] [mode] [N]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+mode=${2:-}
+n=${3:-200}
+prog=$(mktemp)
+trap 'rm -f "$prog"' EXIT
+
+labels="100Mf $((100 + n / 2))Mg"
+echo "$labels 3000000 Mi La fC gC i 1- D Mi D? Ba ; X" > "$prog"
+for ((i = 0; i < n; i++)); do
+  echo "@$((100 + i)) G"
+done >> "$prog"
+
+TIMEFORMAT='%3R s'
+time "$vm" $mode < "$prog"
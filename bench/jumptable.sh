@@ -0,0 +1,24 @@
+#!/bin/bash
+# Times a dispatcher loop, which jumps through a table of N global labels
+# (64 by default) with a computed `G`.  Each entry jumps back to the top of
+# the loop.  Integer labels use the label table's direct index, and SCALE
+# (1 by default) spreads them out: a SCALE over 65535, or a fractional one,
+# puts them in its hash table instead.
+#
+# Usage: bench/jumptable.sh [vm binary] [N] [SCALE]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+n=${2:-64}
+scale=${3:-1}
+prog=$(mktemp)
+trap 'rm -f "$prog"' EXIT
+
+echo "3000000 Mi La i $n % $scale * 1+ G" > "$prog"
+for ((i = 0; i < n; i++)); do
+  label=$(awk "BEGIN { printf \"%.17g\", $i * $scale + 1 }")
+  echo "@$label i 1- D Mi D? Ba ; X"
+done >> "$prog"
+
+TIMEFORMAT='%3R s'
+time "$vm" < "$prog"
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Times a literal-heavy program: examples/numeric_literals.vm, repeated N
+# times (50000 by default).  The program is prefixed with `X` for a second
+# run, which times only loading it: prescanning and predecoding the literals.
+#
+# Usage: bench/literals.sh [vm binary] [N]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+n=${2:-50000}
+prog=$(mktemp)
+trap 'rm -f "$prog"' EXIT
+
+lits=$(< examples/numeric_literals.vm)
+for ((i = 0; i < n; i++)); do
+  printf '%s\n' "$lits"
+done > "$prog"
+
+TIMEFORMAT='%3R s'
+echo "$(wc -c < "$prog") bytes of literals"
+echo -n "load and run: "
+time "$vm" < "$prog" > /dev/null
+echo -n "load only:    "
+time { echo X; cat "$prog"; } | "$vm" > /dev/null
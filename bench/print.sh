@@ -0,0 +1,22 @@
+#!/bin/bash
+# Times printing: a loop that prints N values (10000000 by default) with `'`,
+# a mix of integers and fractions, to /dev/null, with the VM formatting the
+# values itself, with `--async` handing them to the output thread, and with
+# `--binary` writing them unformatted.  The same loop with `P` in place of
+# `'P` times everything but the printing.
+#
+# Usage: bench/print.sh [vm binary] [N]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+n=${2:-10000000}
+
+TIMEFORMAT='%3R s'
+echo -n "print $n values: "
+time echo "$n Mn L1 n 8 / 'P n 1- D Mn ? B1 ;" | "$vm" > /dev/null
+echo -n "with --async:    "
+time echo "$n Mn L1 n 8 / 'P n 1- D Mn ? B1 ;" | "$vm" --async > /dev/null
+echo -n "with --binary:   "
+time echo "$n Mn L1 n 8 / 'P n 1- D Mn ? B1 ;" | "$vm" --binary > /dev/null 2>&1
+echo -n "loop only:       "
+time echo "$n Mn L1 n 8 / P n 1- D Mn ? B1 ;" | "$vm" > /dev/null
@@ -0,0 +1,23 @@
+#!/bin/bash
+# Times `R` at small, medium and huge rotation depths.  Each program builds a
+# stack DEPTH deep (1000000 by default), and then rotates it N times (200000
+# by default), alternately by n and -n, so the stack ends up as it started.
+# The last program rotates an item 100000000 deep into a short stack, which
+# reifies 0s in between, and rotates it back up, 10 times.
+#
+# Usage: bench/rotate.sh [vm binary] [DEPTH] [N]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+depth=${2:-1000000}
+n=${3:-200000}
+
+TIMEFORMAT='%3R s'
+for k in 3 1000 $((depth / 2)) $((depth - 10)); do
+  echo -n "R by $k: "
+  fill="$depth Mi La i 1- D Mi D? Ba ;"
+  time echo "$fill $n Mi Lb $k R $k~R i 1- D Mi D? Bb ; X" | "$vm" > /dev/null
+done
+echo -n "R by -100000000 and back: "
+time echo "10 Mi Lb 7 100000000~R 100000000R ' 100000000Q i 1- D Mi D? Bb ; X" |
+  "$vm" > /dev/null
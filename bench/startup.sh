@@ -0,0 +1,35 @@
+#!/bin/bash
+# Times startup: reading and prescanning a program's text from stdin,
+# prescanning it in place in a file with `--file`, and mapping a precompiled
+# image of it, which `vm --compile` writes.  The program is the examples,
+# repeated to fill each SIZE in MiB (1, 4 and 16 by default), behind an `X`,
+# so only loading it is timed.  Images take about 33 bytes per byte of
+# program, and prescanning takes more memory than that, so sizes up to 1024
+# need a big machine.
+#
+# Usage: bench/startup.sh [vm binary] [SIZE...]
+set -e
+cd "$(dirname "$0")/.."
+vm=${1:-./vm}
+sizes=${*:2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat examples/*.vm > "$dir/examples.vm"
+TIMEFORMAT='%3R s'
+for mb in ${sizes:-1 4 16}; do
+  while (($(wc -c < "$dir/examples.vm") < mb << 20)); do
+    cat "$dir/examples.vm" "$dir/examples.vm" > "$dir/double.vm"
+    mv "$dir/double.vm" "$dir/examples.vm"
+  done
+  { echo X; head -c $((mb << 20)) "$dir/examples.vm"; } > "$dir/prog.vm"
+  "$vm" --compile "$dir/prog.img" < "$dir/prog.vm"
+  echo "$mb MiB program, $(($(wc -c < "$dir/prog.img") >> 20)) MiB image"
+  echo -n "stdin: "
+  time "$vm" < "$dir/prog.vm" > /dev/null
+  echo -n "file:  "
+  time "$vm" --file "$dir/prog.vm" > /dev/null
+  echo -n "image: "
+  time "$vm" --image "$dir/prog.img" > /dev/null
+  rm "$dir/prog.img"
+done
@@ -0,0 +1,157 @@
+#!/bin/bash
+# Runs each program in examples/ every way vm can run it, and compares the
+# output and step count with the program's .out file, which the original
+# interpreter wrote.  A program without one is compared with the reference
+# interpreter, `vm --reference`, instead.  Also checks batch mode and
+# vm-batch against runs one input at a time.  Run by `make check`, after
+# building vm, vmc, vm-batch, vm_profile, vm_threaded and vm_tailcall.
+#
+# Usage: ./check.sh [program ...]
+cd "$(dirname "$0")"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+progs=("$@")
+if [ ${#progs[@]} -eq 0 ]; then
+  progs=(examples/*.vm)
+fi
+CXX=${CXX:-g++}
+
+programs=0
+runs=0
+failures=0
+
+# Compares the output of a command with the expected output in
+# $dir/expected, or in the file given by `-e FILE`.
+check() {
+  local expected=$dir/expected
+  if [ "$1" = -e ]; then
+    expected=$2
+    shift 2
+  fi
+  local name=$1
+  shift
+  runs=$((runs + 1))
+  if ! "$@" > "$dir/actual" 2>&1 || ! cmp -s "$expected" "$dir/actual"; then
+    failures=$((failures + 1))
+    echo "FAIL: $name on $prog"
+    diff "$expected" "$dir/actual" | head -5
+  fi
+}
+
+# The JITs this build of vm has.  Where it has none, they say so, and run
+# the interpreter.
+jits=()
+for jit in --jit --trace-jit --copy-patch; do
+  if ! echo X | ./vm $jit | grep -q "not supported"; then
+    jits+=("$jit")
+  fi
+done
+
+# Runs $prog every way, and compares each with $dir/expected.
+check_modes() {
+  programs=$((programs + 1))
+  check vm ./vm < "$prog"
+  check "vm --reference" ./vm --reference < "$prog"
+  for jit in "${jits[@]}"; do
+    check "vm $jit" ./vm $jit < "$prog"
+  done
+  check vm_threaded ./vm_threaded < "$prog"
+  check vm_tailcall ./vm_tailcall < "$prog"
+  check "vm --file" ./vm --file "$prog"
+  check "vm --async" ./vm --async < "$prog"
+  check "vm --samples" ./vm --samples "$dir/samples" < "$prog"
+  check vm_profile sh -c "./vm_profile 2> /dev/null" < "$prog"
+  ./vm --compile "$dir/prog.img" < "$prog"
+  check "vm --image" ./vm --image "$dir/prog.img"
+  ./vmc < "$prog" > "$dir/prog.cc"
+  check vmc sh -c "$CXX -O1 -o '$dir/prog' '$dir/prog.cc' && '$dir/prog'"
+
+  # Binary output goes to stdout, and the VM's own text to stderr.
+  for format in --binary --binary-pc; do
+    ./vm $format --reference < "$prog" > "$dir/expected.bin" \
+        2> "$dir/expected.err"
+    for mode in "" "${jits[@]}"; do
+      check -e "$dir/expected.err" "vm $format $mode" \
+          sh -c "./vm $format $mode > '$dir/actual.bin'" < "$prog"
+      check -e "$dir/expected.bin" "vm $format $mode output" \
+          cat "$dir/actual.bin"
+    done
+  done
+}
+
+for prog in "${progs[@]}"; do
+  if [ -f "${prog%.vm}.out" ]; then
+    cp "${prog%.vm}.out" "$dir/expected"
+  else
+    ./vm --reference < "$prog" > "$dir/expected" 2>&1
+  fi
+  check_modes
+done
+
+# Batch mode and `vm-batch -i` run each program once per line of $inputs,
+# with its values pushed first.  That must print what `vm` prints for the
+# same program with the values as literals in front, apart from the step
+# counts, as the literals take steps, and the pushes don't.  The two batch
+# runners count steps the same way, so their output must match exactly.
+# The programs after examples/ split the lanes at `?`, `C` and `G`.
+inputs=$dir/inputs
+printf '%s\n' 1 2 3 -1 2.5 3 1 2 '1 2' 0 -3 > "$inputs"
+batch_progs=("${progs[@]}")
+if [ $# -eq 0 ]; then
+  echo "D? 10+' : 10-' ; X" > "$dir/split_if.vm"
+  echo "D? : ~ ; C 0'P X @1 1'P G @2 2'P G @3 3'P G" > "$dir/split_call.vm"
+  echo "D? : ~ ; G @1 1' X @2 2' X @3 3' X" > "$dir/split_goto.vm"
+  echo 'D? : ~ ; \_ Mx 0 Mc L1 x 1.5 - ? x 2 % 0.5 - ? x 3 * 1 + Mx :' \
+      "x 2 / Mx ; c 1 + Mc B1 ; c ' X" > "$dir/split_loop.vm"
+  batch_progs+=("$dir"/split_*.vm)
+  programs=$((programs + ${#batch_progs[@]} - ${#progs[@]}))
+fi
+for prog in "${batch_progs[@]}"; do
+  while read -r line; do
+    literals=
+    for value in $line; do
+      if [ "${value:0:1}" = - ]; then
+        literals+="${value#-}~ "
+      else
+        literals+="$value "
+      fi
+    done
+    { echo "$literals"; cat "$prog"; } | ./vm
+  done < "$inputs" | sed 's/^DONE\..*/DONE./' > "$dir/expected"
+  ./vm --batch "$inputs" < "$prog" > "$dir/batch" 2>&1
+  check "vm --batch" sed 's/^DONE\..*/DONE./' "$dir/batch"
+  check -e "$dir/batch" vm-batch \
+      sh -c "./vm-batch -j 3 -i '$inputs' '$prog' 2> /dev/null"
+done
+
+# The sampler finds calls, and where the run spends its time.
+if [ $# -eq 0 ]; then
+  programs=$((programs + 1))
+  prog=$dir/calls.vm
+  echo "2000 Mn L1 100C n 1- D Mn ? B1 ; X @100 3000 La 1- D? Ba ; P G" \
+      > "$prog"
+  ./vm --samples "$dir/samples" < "$prog" > /dev/null
+  check -e /dev/null "vm --samples stacks" \
+      grep -q '^main 1:[0-9]*;@100 1:[0-9]* [0-9]*$' "$dir/samples"
+fi
+
+# Counts and values beyond int64_t's range convert to its limits, in every
+# mode.  Each case is a program, and then its output.
+limits=(
+  '9999999999999999999 R' 'DONE.  4 steps'
+  "1 0/R '" $'0\nDONE.  8 steps'
+  '0\l~R' 'DONE.  6 steps'
+  "1 0/I ' 1 0/U ' 1 0/Q" $'9.22337e+18\n1.84467e+19\nDONE.  20 steps'
+)
+for ((i = 0; $# == 0 && i < ${#limits[@]}; i += 2)); do
+  prog=$dir/limits$((i / 2)).vm
+  echo "${limits[i]}" > "$prog"
+  echo "${limits[i + 1]}" > "$dir/expected"
+  check_modes
+done
+
+if [ $failures -ne 0 ]; then
+  echo "$failures of $runs runs failed."
+  exit 1
+fi
+echo "All $runs runs of $programs programs match."
@@ -0,0 +1,116 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// libsimplevm runs programs in-process, without spawning `vm`.
+//
+// A Program is prescanned once, and then any number of Machines, on any
+// number of threads, can run it.  A Machine holds one run's state, and can
+// run its program over and over: Reset() keeps the Machine's stack memory
+// and inline caches, so a short run costs neither a prescan nor an
+// allocation.
+//
+//   simplevm::Program program(source);
+//   simplevm::Machine machine(program);
+//   std::string out;
+//   machine.SetOutput(&out);
+//   for (double x : xs) {
+//     machine.Reset();
+//     machine.SetStack({x});
+//     if (!machine.Run(1000000)) {
+//       // Still running after a million steps.
+//     }
+//   }
+//
+// Running a program throws std::bad_alloc if its stack outgrows the
+// memory available to it, as `vm` does.
+
+#ifndef SIMPLEVM_H_
+#define SIMPLEVM_H_
+
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace simplevm {
+
+// A prescanned and translated program.  Programs never change, and copies
+// share the same translation.
+class Program {
+ public:
+  // Prescans and translates a program, given its text.  Line breaks count
+  // as whitespace.
+  explicit Program(std::string_view source);
+
+  // Reads a program from `in`, as `vm` reads one from standard input.
+  static Program Read(std::istream& in);
+
+ private:
+  friend class Machine;
+  struct Impl;
+  std::shared_ptr<const Impl> impl_;
+};
+
+// Runs a Program.  A Machine isn't thread safe, but Machines that share a
+// Program can run on different threads.
+class Machine {
+ public:
+  static constexpr std::int64_t kNoStepLimit =
+      std::numeric_limits<std::int64_t>::max();
+
+  // Starts a run of `program`, with an empty stack and all variables 0.
+  // The program writes to std::cout until SetOutput() says otherwise.
+  explicit Machine(const Program& program);
+  ~Machine();
+  Machine(Machine&& other) noexcept;
+  Machine& operator=(Machine&& other) noexcept;
+
+  // Runs the program until it terminates, or until it has run at least
+  // `max_steps` more steps, whichever comes first.  A superinstruction can
+  // take the run a few steps past `max_steps`, as it always finishes.
+  // Returns true if the program has terminated.  Otherwise, the next call
+  // picks up where this one left off.
+  bool Run(std::int64_t max_steps = kNoStepLimit);
+
+  // Restarts the program from the beginning, with an empty stack and all
+  // variables 0.  This reuses the stack's memory and keeps the inline
+  // caches, and doesn't prescan the program again.
+  void Reset();
+
+  // Appends the program's output to `*out`, which must outlive the runs
+  // that write to it.  Passing nullptr goes back to std::cout.
+  void SetOutput(std::string* out);
+
+  // Sends the program's output to `out`.
+  void SetOutput(std::ostream& out);
+
+  // Gets the stack.  The last item is the top of stack.  Run() keeps the
+  // top of stack apart from the rest, and always has one, so a stack that
+  // a run leaves empty reads back as {0}.  The program itself can't tell
+  // the two apart, as it sees an endless supply of 0s beneath the stack.
+  const std::vector<double>& GetStack() const;
+
+  // Replaces the stack, e.g. to give a run its inputs.  The last item is
+  // the top of stack.
+  void SetStack(const std::vector<double>& stack);
+
+  // Gets a variable, given its bytecode, e.g. 'a'.
+  double GetV(char var) const;
+
+  // Sets a variable, given its bytecode.
+  void SetV(char var, double val);
+
+  // Gets the number of steps run since the start, or since Reset().
+  std::int64_t GetSteps() const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace simplevm
+
+#endif  // SIMPLEVM_H_
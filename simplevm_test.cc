@@ -0,0 +1,180 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// Checks libsimplevm's API, as simplevm.h describes it.  Run by `make check`.
+
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "simplevm.h"
+
+namespace {
+
+int g_checks = 0;
+int g_failures = 0;
+
+void Check(bool ok, const std::string& what) {
+  ++g_checks;
+  if (!ok) {
+    ++g_failures;
+    std::cout << "FAIL: " << what << "\n";
+  }
+}
+
+// Counts down from the input on the stack, printing each count.
+constexpr char kCountdown[] = "La D'P 1- D? Ba ;";
+
+// Runs kCountdown from `from`, to completion, and returns its output.
+std::string Countdown(const simplevm::Program& program, double from,
+                      std::int64_t* steps = nullptr) {
+  simplevm::Machine machine(program);
+  std::string out;
+  machine.SetOutput(&out);
+  machine.SetStack({from});
+  machine.Run();
+  if (steps) {
+    *steps = machine.GetSteps();
+  }
+  return out;
+}
+
+// Run(max_steps) stops early, and the next call picks up where it left off.
+void CheckStepLimit() {
+  const simplevm::Program program(kCountdown);
+  std::int64_t steps = 0;
+  const std::string expected = Countdown(program, 99, &steps);
+  Check(expected.rfind("99\n98\n", 0) == 0, "countdown prints its counts");
+
+  simplevm::Machine machine(program);
+  std::string out;
+  machine.SetOutput(&out);
+  machine.SetStack({99});
+  int calls = 0;
+  bool early = true;
+  while (!machine.Run(10)) {
+    ++calls;
+    early = early && machine.GetSteps() < steps;
+  }
+  Check(calls > 10, "Run(10) takes many calls");
+  Check(early, "Run(10) stops before the end");
+  Check(out == expected, "Run(10) prints what Run() prints");
+  Check(machine.GetSteps() == steps, "Run(10) runs as many steps as Run()");
+
+  // Once the program has terminated, Run() does nothing more.
+  Check(machine.Run(), "Run() after termination returns true");
+  Check(machine.Run(10), "Run(10) after termination returns true");
+  Check(out == expected, "Run() after termination prints nothing");
+  Check(machine.GetSteps() == steps, "Run() after termination runs no steps");
+}
+
+// Reset() and SetStack() run the program again, on a new input.
+void CheckReset() {
+  const simplevm::Program program("D*");
+  simplevm::Machine machine(program);
+  machine.SetStack({3});
+  machine.Run();
+  const std::int64_t steps = machine.GetSteps();
+  Check(machine.GetStack() == std::vector<double>{9}, "D* squares 3");
+
+  machine.Reset();
+  Check(machine.GetSteps() == 0, "Reset() clears the step count");
+  Check(machine.GetStack().empty(), "Reset() empties the stack");
+  machine.SetStack({1, 4});
+  Check(!machine.Run(0), "Run(0) runs nothing");
+  machine.Run();
+  Check(machine.GetStack() == std::vector<double>{1, 16},
+        "D* squares 4 after Reset()");
+  Check(machine.GetSteps() == steps, "a rerun takes the same steps");
+
+  // An empty stack reads back as {0} after Run().
+  const simplevm::Program drop("P");
+  simplevm::Machine dropper(drop);
+  dropper.SetStack({5});
+  dropper.Run();
+  Check(dropper.GetStack() == std::vector<double>{0},
+        "an emptied stack reads back as {0}");
+}
+
+// SetOutput(std::string*) appends to the string, and nullptr goes back to
+// std::cout.
+void CheckOutput() {
+  const simplevm::Program program("42'");
+  simplevm::Machine machine(program);
+  std::string out = "before\n";
+  machine.SetOutput(&out);
+  machine.Run();
+  Check(out == "before\n42\n", "SetOutput(&str) appends to str");
+
+  std::ostringstream cout_text;
+  std::streambuf* const cout_buf = std::cout.rdbuf(cout_text.rdbuf());
+  machine.SetOutput(nullptr);
+  machine.Reset();
+  machine.Run();
+  std::cout.rdbuf(cout_buf);
+  Check(out == "before\n42\n", "SetOutput(nullptr) leaves str alone");
+  Check(cout_text.str() == "42\n", "SetOutput(nullptr) writes to std::cout");
+
+  std::ostringstream stream;
+  machine.SetOutput(stream);
+  machine.Reset();
+  machine.Run();
+  Check(stream.str() == "42\n", "SetOutput(stream) writes to stream");
+}
+
+// GetV() and SetV() reach the program's variables.
+void CheckVariables() {
+  const simplevm::Program program("a 2* Mb");
+  simplevm::Machine machine(program);
+  machine.SetV('a', 21);
+  Check(machine.GetV('a') == 21, "GetV() reads what SetV() wrote");
+  machine.Run();
+  Check(machine.GetV('b') == 42, "the program reads and writes variables");
+  machine.Reset();
+  Check(machine.GetV('a') == 0 && machine.GetV('b') == 0,
+        "Reset() clears the variables");
+}
+
+// Machines on different threads can share a Program.
+void CheckThreads() {
+  const simplevm::Program program(kCountdown);
+  const std::string expected[2] = {Countdown(program, 1000),
+                                   Countdown(program, 2000)};
+  std::string out[2];
+  std::vector<std::thread> threads;
+  for (int i = 0; i != 2; ++i) {
+    threads.emplace_back([&, i] {
+      simplevm::Machine machine(program);
+      machine.SetOutput(&out[i]);
+      for (int run = 0; run != 100; ++run) {
+        out[i].clear();
+        machine.Reset();
+        machine.SetStack({1000. * (i + 1)});
+        machine.Run();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  Check(out[0] == expected[0], "the first thread's runs are right");
+  Check(out[1] == expected[1], "the second thread's runs are right");
+}
+
+}  // namespace
+
+int main() {
+  CheckStepLimit();
+  CheckReset();
+  CheckOutput();
+  CheckVariables();
+  CheckThreads();
+  if (g_failures != 0) {
+    std::cout << g_failures << " of " << g_checks << " checks failed.\n";
+    return 1;
+  }
+  std::cout << "All " << g_checks << " library checks pass.\n";
+}
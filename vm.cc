@@ -1,287 +1,313 @@
 // Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
 // SPDX-License-Identifier:  CC-BY-SA-4.0
-#include <algorithm>
-#include <array>
-#include <cctype>
-#include <cmath>
-#include <cstdint>
-#include <functional>
-#include <iostream>
-#include <limits>
-#include <map>
-#include <string>
-#include <string_view>
-#include <vector>
 
-namespace {
-
-using std::int64_t;
-
-bool g_debug_branch_opt = false;
-
-class VM {
- public:
-  using LocType = int64_t;
-  using ValueType = double;
-  using ByteType = unsigned char;
+#include "vm_internal.h"
 
-  explicit VM(std::string_view prog) : prog_(prog) { Prescan(); }
+#if VM_SAMPLING
+#include <signal.h>
+#include <sys/time.h>
+#endif
 
-  // Runs the program until completion.
-  void Run() {
-    do {
-      terminate_ = false;
-      Step();
-    } while (!terminate_);
-  }
+#if VM_LIBRARY
+#include "simplevm.h"
+#endif
 
-  // Single-steps the program.
-  bool Step();
+#if VM_BATCH
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#endif
 
-  // Gets a variable, given its bytecode.
-  ValueType GetV(ByteType var) const {
-    return var_[var];
-  }
+#if VM_PROFILE
+#include <iomanip>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
 
-  // Sets a variable to a given value.
-  void SetV(ByteType var, ValueType val) {
-    var_[var] = val;
-  }
+namespace simplevm::internal {
 
-  // Gets the current PC.
-  LocType GetPc() const {
-    return pc_;
-  }
+bool g_debug_branch_opt = false;
 
-  // Sets the current PC.
-  void SetPc(LocType loc) {
-    pc_ = loc;
-  }
+// A precompiled image starts with this header.  The translation, call
+// sites, global labels and text follow, in that order, each padded to a
+// multiple of 8 bytes.  The labels are (label, PC) pairs.
+struct VM::Program::ImageHeader {
+  static constexpr char kMagic[8] = {'S', 'V', 'M', 'I', 'M', 'G', '\n', 0};
+  // Bump this whenever Insn, the opcodes or the translation change.
+  static constexpr std::uint32_t kVersion = 2;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t insn_size;  // sizeof(Insn)
+  std::uint64_t prog_size;
+  std::uint64_t code_size;
+  std::uint64_t call_sites;
+  std::uint64_t labels;
+};
 
-  // Gets a read-only reference to the stack_.
-  const std::vector<ValueType>& GetStack() const {
-    return stack_;
+std::shared_ptr<const VM::Program> VM::Program::MapText(const char* path) {
+  auto file = std::make_unique<const MappedFile>(path);
+  if (!file->ok()) {
+    return nullptr;
   }
 
-  // Gets the total number of steps executed.  This is the actual step count,
-  // and reflects any optimizations the prescanner performed, for example.
-  int64_t GetSteps() const {
-    return steps_;
+  // Program's constructor is private, so this can't use make_shared.
+  std::shared_ptr<Program> program(new Program());
+  program->prog_ = file->bytes();
+  // ReadProgram() puts a line break after the last line.  Text that doesn't
+  // end in one needs a copy with some whitespace there.
+  if (!program->prog_.empty() && program->prog_.back() != '\n') {
+    program->text_ = program->prog_;
+    program->text_ += ' ';
+    program->prog_ = program->text_;
+  } else {
+    program->file_ = std::move(file);
   }
+  program->Build();
+  return program;
+}
 
-  // Gets the bytecode at a given PC.  Returns `X` (the termination bytecode)
-  // if PC is out of range.
-  ByteType ByteAt(LocType loc) const {
-    if (loc < 0 || loc >= prog_.size()) {
-      return kTerminateByte;
+std::shared_ptr<const VM::Program> VM::Program::MapImage(const char* path) {
+  auto file = std::make_unique<const MappedFile>(path);
+  std::string_view rest = file->bytes();
+  // Carves the next `count` items of type T off the front of `rest`, with
+  // their padding.  Returns false if there aren't enough.
+  const auto take = [&rest](std::uint64_t count, auto* span) {
+    using T = std::remove_reference_t<decltype((*span)[0])>;  // const
+    if (count > rest.size() / sizeof(T)) {
+      return false;
     }
-    return prog_[loc];
-  }
-
- private:
-  using ValueLocPair = std::pair<ValueType, LocType>;
-
-  static constexpr LocType kTerminatePc = std::numeric_limits<LocType>::max();
-  static constexpr ByteType kTerminateByte = 'X';
-  static constexpr ByteType kByteMax = std::numeric_limits<ByteType>::max();
-
-  std::string prog_{};
-  std::vector<LocType> branch_target_{};
-
-  std::array<ValueType, kByteMax + 1> var_{};
-  std::vector<ValueType> stack_{};
-  std::map<LocType, ValueType> predec_values_{};
-  std::map<double, LocType> global_label_{};
-  LocType pc_ = 0;
-  int64_t steps_ = 0;
-  bool terminate_ = false;
+    *span = {reinterpret_cast<T*>(rest.data()), count};
+    rest.remove_prefix(std::min<std::uint64_t>(
+        (count * sizeof(T) + 7) & ~std::uint64_t(7), rest.size()));
+    return true;
+  };
 
-  // Gets the next bytecode, advancing the PC.  Returns `X` (the termination
-  // bytecode) if PC is out of range.
-  ByteType NextByte() {
-    if (pc_ < 0 || pc_ >= prog_.size()) {
-      return kTerminateByte;
-    }
-    return prog_[pc_++];
+  Span<ImageHeader> header;
+  if (!take(1, &header) ||
+      std::memcmp(header[0].magic, ImageHeader::kMagic,
+                  sizeof(ImageHeader::kMagic)) != 0 ||
+      header[0].version != ImageHeader::kVersion ||
+      header[0].insn_size != sizeof(Insn) ||
+      header[0].code_size != header[0].prog_size + kStopSlot + 1) {
+    return nullptr;
   }
-
-  // Pushes an item onto the stack_.
-  void Push(double val) {
-    stack_.push_back(val);
+  std::shared_ptr<Program> program(new Program());
+  Span<std::pair<ValueType, LocType>> labels;
+  Span<char> text;
+  if (!take(header[0].code_size, &program->image_code_) ||
+      !take(header[0].call_sites, &program->image_call_sites_) ||
+      !take(header[0].labels, &labels) ||
+      !take(header[0].prog_size, &text)) {
+    return nullptr;
   }
-
-  // Returns the top of stack_.  Underflowing the stack is not an error.  It
-  // behaves as if there's an infinite well of 0s beneath it.
-  ValueType Pop() {
-    ValueType val = 0;
-    if (!stack_.empty()) {
-      val = stack_.back();
-      stack_.pop_back();
+  program->prog_ = {text.data(), text.size()};
+
+  // The run loops, the JITs and the stencils all trust the translation, so
+  // a stale or corrupt image must not get this far.  Check everything they
+  // index with: each PC is in the code, or kTerminatePc, each `C` and `G`
+  // has an inline cache, and the terminating instructions are in place, so
+  // that no instruction can step past the end.
+  const Span<Insn> code = program->image_code_;
+  const Span<LocType> call_sites = program->image_call_sites_;
+  const LocType prog_size = text.size();
+  const auto pc_ok = [&](LocType pc) {
+    return (pc >= 0 && std::uint64_t(pc) < code.size()) || pc == kTerminatePc;
+  };
+  for (LocType loc = 0; loc != LocType(code.size()); ++loc) {
+    const Insn& insn = code[loc];
+    const bool uses_cache = insn.op == kOpCall || insn.op == kOpGoto ||
+                            insn.base_op == kOpCall ||
+                            insn.base_op == kOpGoto;
+    if (insn.op >= kNumOps || insn.base_op >= kNumOps ||
+        !pc_ok(insn.next) ||
+        !(uses_cache ? insn.target >= 0 &&
+                           std::uint64_t(insn.target) < call_sites.size()
+                     : pc_ok(insn.target)) ||
+        (loc >= prog_size &&
+         insn.op != (loc == prog_size + kStopSlot ? kOpStop : kOpHalt))) {
+      return nullptr;
     }
-    return val;
   }
-
-  // Returns a reference to top of stack_.  You must not use this reference
-  // after a Push() or Pop().
-  ValueType& Top() {
-    if (stack_.empty()) {
-      stack_.push_back(0.);
+  for (const LocType loc : call_sites) {
+    if (loc < 0 || loc >= prog_size) {
+      return nullptr;
     }
-    return stack_.back();
   }
-
-  // Converts the double to an integer that fits within an int64_t.  Treats
-  // NaN as 0.
-  static int64_t Int(ValueType val) {
-    double d = double(val);
-    if (std::isnan(d)) {
-      d = 0;
+  for (const auto& [label, pc] : labels) {
+    if (!pc_ok(pc)) {
+      return nullptr;
     }
-    return int64_t(std::clamp(d, double(INT64_MIN), double(INT64_MAX)));
+    program->global_label_.Set(label, pc);
   }
+  program->file_ = std::move(file);
+  return program;
+}
 
-  // Converts the double to an integer that fits within an uint64_t.  Treats
-  // NaN as 0.
-  static uint64_t Uint(ValueType val) {
-    double d = double(val);
-    if (std::isnan(d)) {
-      d = 0;
-    }
-    return uint64_t(std::clamp(d, 0., double(UINT64_MAX)));
+void VM::Program::WriteImage(std::ostream& out) const {
+  const Span<Insn> code = Code();
+  const Span<LocType> call_sites = CallSites();
+  ImageHeader header{};
+  std::memcpy(header.magic, ImageHeader::kMagic, sizeof(header.magic));
+  header.version = ImageHeader::kVersion;
+  header.insn_size = sizeof(Insn);
+  header.prog_size = prog_.size();
+  header.code_size = code.size();
+  header.call_sites = call_sites.size();
+  header.labels = global_label_.size();
+
+  std::vector<std::pair<ValueType, LocType>> labels;
+  labels.reserve(global_label_.size());
+  LabelTable(global_label_).ForEach([&](ValueType label, LocType pc) {
+    labels.emplace_back(label, pc);
+  });
+
+  const auto write = [&out](const void* data, std::size_t size) {
+    static constexpr char kPadding[8] = {};
+    out.write(static_cast<const char*>(data), size);
+    out.write(kPadding, -size & 7);
+  };
+  write(&header, sizeof(header));
+  // Insn has padding, which would carry whatever was in memory into the
+  // image, so write the fields one at a time, into zeroed slots.  The same
+  // program then always gives the same image.
+  for (const Insn& insn : code) {
+    char bytes[sizeof(Insn)] = {};
+    const auto put = [&bytes](std::size_t offset, const auto& field) {
+      std::memcpy(bytes + offset, &field, sizeof(field));
+    };
+    put(offsetof(Insn, op), insn.op);
+    put(offsetof(Insn, base_op), insn.base_op);
+    put(offsetof(Insn, reg), insn.reg);
+    put(offsetof(Insn, code), insn.code);
+    put(offsetof(Insn, next), insn.next);
+    put(offsetof(Insn, target), insn.target);
+    put(offsetof(Insn, val), insn.val);
+    out.write(bytes, sizeof(bytes));
   }
+  write(call_sites.data(), call_sites.size() * sizeof(LocType));
+  write(labels.data(), labels.size() * sizeof(labels[0]));
+  write(prog_.data(), prog_.size());
+}
 
-  // Converts the double to a "Natural" number (non-negative integer) that
-  // fits within an int64_t.  Treats NaN as 0.
-  static int64_t Nat(ValueType val) {
-    double d = double(val);
-    if (std::isnan(d)) {
-      d = 0;
-    }
-    return int64_t(std::clamp(d, 0., double(INT64_MAX)));
+VM::VM(std::shared_ptr<const Program> program)
+    : program_(std::move(program)),
+      prog_(program_->prog_),
+      code_(program_->Code()),
+      global_label_(program_->global_label_),
+      call_cache_(program_->CallSites().size()) {
+  for (std::size_t site = 0; site != call_cache_.size(); ++site) {
+    call_cache_[site].loc = program_->CallSites()[site];
   }
+}
 
-  // Resolves a destination into a PC address.  Positive values correspond to
-  // global labels, while negative values are the bitwise inverse of a PC
-  // address.
-  LocType Resolve(ValueType val) {
-    double dst = double(val);
-    if (dst < 0.) {
-      return ~Int(dst);
-    }
-
-    if (std::isnormal(dst)) {
-      auto it = global_label_.find(dst);
-      if (it != global_label_.end()) {
-        return it->second;
+VM::VM(std::string_view prog) : VM(std::make_shared<const Program>(prog)) {}
+
+#if VM_ASYNC_OUTPUT
+void VM::AsyncOutput::Write() {
+  const auto text = std::make_unique<char[]>(kOutputBufSize);
+  char* const limit = text.get() + kOutputBufSize - kMaxFormatLn;
+  char* pos = text.get();
+  std::size_t tail = 0;
+  for (;;) {
+    const std::size_t head =
+        std::min(head_shared_.load(std::memory_order_acquire),
+                 tail + kBatch);
+    if (head != tail) {
+      for (; tail != head; ++tail) {
+        if (pos >= limit) {
+          vm_.out_->write(text.get(), pos - text.get());
+          pos = text.get();
+        }
+        pos = FormatLn(pos, ring_[tail % kRingSize]);
       }
+      tail_.store(tail);
+      WakeVm();
+      continue;
     }
 
-    return kTerminatePc;  // Not found?  Terminate.
-  }
-
-  // Drops the top N elements of the stack_.
-  void DropN(int64_t n) {
-    if (n > 0 && n < stack_.size()) {
-      stack_.resize(stack_.size() - n);
-    } else if (n >= stack_.size()) {
-      stack_.clear();
+    // Caught up.  Write out the text, and sleep until there's more.
+    if (pos != text.get()) {
+      vm_.out_->write(text.get(), pos - text.get());
+      pos = text.get();
     }
-  }
-
-  // Rotates the top N elements of the stack by extracting the Nth element
-  // from the top, sliding everything else down, and pushing the extracted
-  // element at the top.  0 leaves the stack unmodified, while 1 swaps the
-  // top two elements.
-  void Rotate(int64_t n) {
-    // C++'s integer promotion rules cause problems for signed vs. unsigned
-    // comparisons.  So, pull out the negative cases for `n` first.
-
-    if (n < 0) {
-      const auto old_tos = Pop();  // This handles the empty stack case too.
-      const auto pn = uint64_t(-n);
-
-      // We must reify virtual stack elements if -n > size().  To avoid O(n^2)
-      // behavior for certain pathological programs, we'll grow the stack to
-      // whatever power of 2 is greater or equal to -n.
-      if (pn > stack_.size()) {
-        // Old-school trick to find a power of 2 greater than to another
-        // integer.
-        auto x = pn;
-        x = x | (x >> 1);
-        x = x | (x >> 2);
-        x = x | (x >> 4);
-        x = x | (x >> 6);
-        x = x | (x >> 16);
-        x = x | (x >> 32);
-        x += 1;
-        stack_.insert(stack_.begin(), x, 0.);
-
-        // Since the above guarantees the new stack is at least 1 larger
-        // than necessary, we can simply overwrite the reified 0.
-        const auto it = stack_.end() - pn - 1;
-        *it = old_tos;
-      } else {
-        // Just insert the item, and pay for the O(n) copy.
-        stack_.insert(stack_.end() + n, 1, old_tos);
-      }
-    } else if (n >= int64_t(stack_.size())) {
-      Push(0.);
-    } else if (n > 0) {
-      std::size_t idx = stack_.size() - n - 1;
-      double val = stack_[idx];
-      stack_.erase(stack_.begin() + idx);
-      Push(val);
+    written_.store(tail);
+    WakeVm();
+    writer_idle_.store(true);
+    if (head_shared_.load() == tail && !stop_.load()) {
+      Sleep(&writer_wake_);
+    } else if (!writer_idle_.exchange(false)) {
+      Sleep(&writer_wake_);  // Take the post that's on its way.
+    }
+    if (stop_.load() && head_shared_.load() == tail) {
+      return;
     }
   }
-
-  // Prints the argument followed by a newline.
-  static void PrintLn(ValueType val) {
-    std::cout << val << '\n';
-  }
-
-  // Prints the argument.
-  static void Print(ValueType val) {
-    std::cout << val;
-  }
-
-  // Flatten whitespace down to ' '.
-  static ByteType FixWs(ByteType bc) {
-    return std::isspace(bc) ? ' ' : bc;
+}
+#endif  // VM_ASYNC_OUTPUT
+
+void VM::SetOutputFormat(OutputFormat format) {
+  FlushOutput();
+  out_format_ = format;
+#if VM_ASYNC_OUTPUT
+  if (format != OutputFormat::kText) {
+    async_out_.reset();
   }
+#endif
+}
 
-  using DblFxn1 = double(double);
-  using DblFxn2 = double(double, double);
-
-  // Helper template for one-operand bytecodes.
-  template <typename Callable>
-  void OneOp(Callable fxn) {
-    Top() = fxn(Top());
+void VM::SetAsyncOutput() {
+#if VM_ASYNC_OUTPUT
+  FlushOutput();
+  if (!async_out_ && out_format_ == OutputFormat::kText) {
+    async_out_ = std::make_unique<AsyncOutput>(*this);
   }
+#endif
+}
 
-  // Helper template for two-operand bytecodes.
-  template <typename Callable>
-  void TwoOp(Callable fxn) {
-    auto rhs = Pop();
-    Top() = fxn(Top(), rhs);
+// Finds the run of literal bytecodes starting at `loc`, and where each of
+// its digits stops mattering.
+void VM::Program::LiteralRun::Scan(const Program& program, LocType start) {
+  auto is_literal = [&](LocType loc) {
+    const ByteType bytecode = program.ByteAt(loc);
+    return bytecode == '.' || (bytecode >= '0' && bytecode <= '9');
+  };
+  begin = start;
+  end = start;
+  while (is_literal(end)) {
+    ++end;
   }
-
-  // Helper template for two-operand bytecodes.
-  template <typename Callable>
-  void TwoOpUint(Callable fxn) {
-    auto rhs = Pop();
-    Top() = fxn(Uint(Top()), Uint(rhs));
+  next_point.resize(end - begin);
+  next_nonzero.resize(end - begin);
+  LocType point = end;
+  LocType nonzero = end;
+  for (LocType loc = end; loc-- != begin;) {
+    const ByteType bytecode = program.ByteAt(loc);
+    if (bytecode == '.') {
+      point = loc;
+    }
+    if (bytecode != '0') {
+      nonzero = loc;
+    }
+    next_point[loc - begin] = point;
+    next_nonzero[loc - begin] = nonzero;
   }
-
-  std::pair<ValueType, LocType> GetNumber(LocType loc);
-  void Prescan();
-};
-
+}
 
 // Parses a number in the bytecode stream at the given location in the bytecode
 // stream.  Returns the number, and the location of the first bytecode after it.
-VM::ValueLocPair VM::GetNumber(VM::LocType loc) {
-  if (auto it = predec_values_.find(loc); it != predec_values_.end()) {
-    return { it->second, branch_target_[loc + 1] };
+//
+// Given the run of literal bytecodes that `loc` lies in, this skips digits
+// that can't change the result: zeros while the value is still zero, and
+// any digits once the value or the place has overflowed to infinity.  That
+// bounds each decode by the range of a double, not the length of the run.
+VM::ValueLocPair VM::Program::GetNumber(LocType loc, const LiteralRun* run) {
+  if (predecoded_[loc]) {
+    return { predec_values_[loc], branch_target_[loc + 1] };
   }
 
   enum NumState {
@@ -304,25 +330,35 @@ VM::ValueLocPair VM::GetNumber(VM::LocType loc) {
         double digit_val = bytecode - '0';
 
         switch (num_state) {
-          case kNsIdle: {
-            val = digit_val;
-            num_state = kNsInteger;
-            continue;
-          }
-          case kNsInteger: {
+          case kNsIdle: case kNsInteger: {
             val = val * 10. + digit_val;
+            num_state = kNsInteger;
+            if (run && std::isinf(val)) {
+              loc = run->NextPoint(loc);
+            } else if (run && val == 0.) {
+              loc = run->NextNonZero(loc);
+            }
             continue;
           }
           case kNsFraction: {
             val += digit_val / p;
             p *= 10.;
+            if (run && std::isinf(p)) {
+              loc = run->NextPoint(loc);
+            }
             continue;
           }
           case kNsExponent: {
             p = p * 10. + digit_val;
+            if (run && std::isinf(p)) {
+              loc = run->NextPoint(loc);
+            } else if (run && p == 0.) {
+              loc = run->NextNonZero(loc);
+            }
             continue;
           }
         }
+        break;
       }
 
       case '.': {
@@ -344,6 +380,7 @@ VM::ValueLocPair VM::GetNumber(VM::LocType loc) {
             continue;
           }
         }
+        break;
       }
 
       default: {
@@ -359,11 +396,24 @@ VM::ValueLocPair VM::GetNumber(VM::LocType loc) {
   }
 
   predec_values_[orig_loc] = val;
+  predecoded_[orig_loc] = true;
   branch_target_[orig_loc + 1] = loc;
   return { val, loc };
 }
 
 
+// Prescans, translates and fuses the program, and then frees the tables
+// that only those need.  The translation takes sizeof(Insn) bytes per byte
+// of program, and the tables take about 17 more while they last.
+void VM::Program::Build() {
+  Prescan();
+  Translate();
+  Fuse();
+  std::vector<LocType>().swap(branch_target_);
+  std::vector<ValueType>().swap(predec_values_);
+  std::vector<bool>().swap(predecoded_);
+}
+
 // Prescans the program, establishing the location of all global and local
 // labels, and the values of all numbers.  This allows for fast lookup
 // without scanning at run-time.
@@ -385,8 +435,8 @@ VM::ValueLocPair VM::GetNumber(VM::LocType loc) {
 // Note:  Global branches can't be resolved since they draw their argument from
 // the stack.  Predecoding literals gets us most of that anyway.
 //
-// This should only be called once, from the contructor.
-void VM::Prescan() {
+// This should only be called once, from Build().
+void VM::Program::Prescan() {
   struct ThenElse {
     LocType after_then;
     LocType after_else;
@@ -396,11 +446,13 @@ void VM::Prescan() {
 
   // Branch target array is indexed by PC after fetching the bytecode (PC+1).
   branch_target_.resize(prog_.length() + 1, kTerminatePc);
+  predec_values_.resize(prog_.length() + 1);
+  predecoded_.resize(prog_.length() + 1);
 
   // Forward pass.
   std::array<LocType, kByteMax + 1> recent_local{};
   std::fill(recent_local.begin(), recent_local.end(), kTerminatePc);
-  for (LocType loc = 0; loc != prog_.size();) {
+  for (LocType loc = 0; loc != LocType(prog_.size());) {
     const ByteType bytecode = FixWs(ByteAt(loc++));
 
     switch (bytecode) {
@@ -409,7 +461,7 @@ void VM::Prescan() {
 
       case '@': {
         auto [val, new_loc] = GetNumber(loc);
-        global_label_[val] = new_loc;
+        global_label_.Set(val, new_loc);
         branch_target_[loc] = new_loc;
         // In the unlikely event someone jumps into the middle of a global label
         // definition, GetNumber will do the right thing.  For now, optimize
@@ -483,9 +535,8 @@ void VM::Prescan() {
 
   // Branch-to-branch pass.
   std::vector<LocType> branch_froms;
-  for (LocType loc = 0; loc != prog_.size();) {
-    const ByteType bytecode = ByteAt(loc++);
-    LocType branch_from_loc = loc;
+  for (LocType loc = 0; loc != LocType(prog_.size());) {
+    LocType branch_from_loc = ++loc;
     LocType branch_target_loc = branch_target_[loc];
 
     branch_froms.clear();
@@ -529,7 +580,7 @@ void VM::Prescan() {
   // branch, we can redirect the global label to its ultimate target as well.
   // At this point we don't need to step through the chain of targets as that's
   // just been flattened.
-  for (auto& [label, target] : global_label_) {
+  global_label_.ForEach([&](ValueType label, LocType& target) {
     ByteType target_byte = FixWs(ByteAt(target));
     if (target_byte == 'L' || target_byte == 'F' || target_byte == 'B' ||
         target_byte == '@' || target_byte == ':' || target_byte == ' ' ||
@@ -540,172 +591,1907 @@ void VM::Prescan() {
       }
       target = branch_target_[target + 1];
     }
+  });
+}
+
+// Maps a bytecode after FixWs(), or Esc(b) for a library escape `\b`, to its
+// opcode.
+VM::Op VM::Decode(int code) {
+  switch (code) {
+    case 'X': return kOpHalt;
+
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': case '.': {
+      return kOpLiteral;
+    }
+
+    case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g':
+    case 'h': case 'i': case 'j': case 'k': case 'l': case 'm': case 'n':
+    case 'o': case 'p': case 'q': case 'r': case 's': case 't': case 'u':
+    case 'v': case 'w': case 'x': case 'y': case 'z': case 'V': {
+      return kOpPushVar;
+    }
+
+    case '+': return kOpAdd;
+    case '-': return kOpSub;
+    case '*': return kOpMul;
+    case '/': return kOpDiv;
+    case '~': return kOpNeg;
+    case '%': return kOpMod;
+    case '&': return kOpAnd;
+    case '|': return kOpOr;
+    case '^': return kOpXor;
+    case '<': return kOpShl;
+    case '>': return kOpShr;
+    case '\'': return kOpPrintTop;
+    case '!': return kOpPrintVar;
+    case 'C': return kOpCall;
+    case 'G': return kOpGoto;
+    case 'I': return kOpInt;
+    case 'U': return kOpUint;
+    case 'M': return kOpStore;
+    case 'D': return kOpDup;
+    case 'P': return kOpDrop;
+    case 'Q': return kOpDropN;
+    case 'R': return kOpRotate;
+    case 'S': return kOpSwap;
+    case '?': return kOpIf;
+    case 'L': case '@': case ':': case 'B': case 'F': case ' ': case ';': {
+      return kOpJump;
+    }
+
+    // Library escapes.
+    case Esc('^'): return kOpEscPow;
+    case Esc('h'): return kOpEscHypot;
+    case Esc('H'): return kOpEscHypot3;
+    case Esc('a'): return kOpEscAtan2;
+    case Esc('s'): return kOpEscSin;
+    case Esc('S'): return kOpEscAsin;
+    case Esc('c'): return kOpEscCos;
+    case Esc('C'): return kOpEscAcos;
+    case Esc('t'): return kOpEscTan;
+    case Esc('T'): return kOpEscAtan;
+    case Esc('x'): return kOpEscSinh;
+    case Esc('X'): return kOpEscAsinh;
+    case Esc('y'): return kOpEscCosh;
+    case Esc('Y'): return kOpEscAcosh;
+    case Esc('z'): return kOpEscTanh;
+    case Esc('Z'): return kOpEscAtanh;
+    case Esc('v'): return kOpEscErf;
+    case Esc('V'): return kOpEscErfc;
+    case Esc('u'): return kOpEscTgamma;
+    case Esc('U'): return kOpEscLgamma;
+    case Esc('e'): return kOpEscExp;
+    case Esc('l'): return kOpEscLog;
+    case Esc('2'): return kOpEscLog2;
+    case Esc('q'): return kOpEscSqrt;
+    case Esc('3'): return kOpEscCbrt;
+    case Esc('>'): return kOpEscCeil;
+    case Esc('<'): return kOpEscFloor;
+    case Esc('_'): return kOpEscTrunc;
+    case Esc('|'): return kOpEscAbs;
+    case Esc('i'): return kOpEscRound;
+    case Esc('I'): return kOpEscNearbyInt;
+    case Esc('f'): return kOpEscFrexp;
+    case Esc('F'): return kOpEscLdexp;
+    case Esc('m'): return kOpEscModf;
+    case Esc('-'): return kOpEscSignBit;
+    case Esc('+'): return kOpEscCopySign;
+
+    default: return kOpUndefined;
   }
 }
 
-bool VM::Step() {
-  int bytecode = FixWs(NextByte());
-  // Floating point escape bytecodes.
-  auto Esc = [](ByteType b) { return b + kByteMax + 1; };
+// Translates the program into `code_`, decoding every location once so that
+// Step() never has to look at `prog_`.  Runs after Prescan(), so literal
+// values and branch targets are already resolved; this just copies them into
+// the instructions that use them.  Every location is decoded, not just those
+// reachable in sequence, as `C` and `G` may land anywhere.
+//
+// This should only be called once, from Build(), after Prescan().
+void VM::Program::Translate() {
+  code_.resize(prog_.size() + kStopSlot + 1);
+
+  // Every suffix of a literal is a literal too, which something may branch
+  // to, so this decodes a literal at every location in a run of them.
+  LiteralRun run;
+  for (LocType loc = 0; loc != LocType(prog_.size()); ++loc) {
+    Insn& insn = code_[loc];
+    insn.code = FixWs(ByteAt(loc));
+    insn.next = loc + 1;
+
+    switch (insn.code) {
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9': case '.': {
+        if (loc >= run.end) {
+          run.Scan(*this, loc);
+        }
+        auto [val, new_loc] = GetNumber(loc, &run);
+        insn.val = val;
+        insn.next = new_loc;
+        break;
+      }
+
+      case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g':
+      case 'h': case 'i': case 'j': case 'k': case 'l': case 'm': case 'n':
+      case 'o': case 'p': case 'q': case 'r': case 's': case 't': case 'u':
+      case 'v': case 'w': case 'x': case 'y': case 'z': {
+        insn.reg = insn.code;
+        break;
+      }
+
+      case '!': case 'M': case 'V': {
+        insn.reg = ByteAt(loc + 1);
+        insn.next = ArgNext(loc);
+        insn.target = loc;
+        break;
+      }
+
+      // Binary output records the PC of each print.  The instruction that
+      // does the printing may be a copy, as in a stencil, so it carries it.
+      case '\'': {
+        insn.target = loc;
+        break;
+      }
+
+      case '\\': {
+        insn.code = Esc(ByteAt(loc + 1));
+        insn.next = ArgNext(loc);
+        break;
+      }
+
+      case 'C': case 'G': {
+        insn.target = call_sites_.size();
+        call_sites_.push_back(loc);
+        break;
+      }
+
+      case '?': case 'L': case '@': case ':': case 'B': case 'F': case ' ':
+      case ';': {
+        insn.target = branch_target_[loc + 1];
+        break;
+      }
+    }
+
+    insn.op = insn.base_op = Decode(insn.code);
+  }
+
+  // The terminating instructions past the end (see kHaltSlots) are already
+  // kOpHalt.  Halting there leaves the PC out of range.
+  for (LocType loc = prog_.size(); loc != LocType(code_.size()); ++loc) {
+    code_[loc].next = kTerminatePc;
+  }
+  code_.back().op = code_.back().base_op = kOpStop;
+}
 
+// Fuses common bytecode sequences into superinstructions for the fast run
+// loops, such as `1-`, `D?`, `DD*`, `'P`, `S?`, and a literal feeding `R`,
+// `Q`, `C` or `G`.  Only the instruction at the head of a sequence changes,
+// and only its `op`.  Every other location keeps its own instruction, so a
+// branch into the middle of a sequence runs the rest of it unfused.  Step()
+// ignores fusion altogether, so traces look the same either way.
+//
+// A literal fuses with the instruction it falls through to, at `next`, just
+// past its last digit.  Whitespace is an instruction of its own, with a step
+// of its own, so `1-` fuses but `1 -` doesn't.
+//
+// This should only be called once, from Build(), after Translate().
+void VM::Program::Fuse() {
+  const LocType size = prog_.size();
+
+  // Gets the base opcode at a location, treating those past the end as halt.
+  auto BaseOpAt = [&](LocType loc) {
+    return loc >= 0 && loc < size ? code_[loc].base_op : kOpHalt;
+  };
+
+  for (LocType loc = 0; loc != size; ++loc) {
+    Insn& insn = code_[loc];
+
+    switch (insn.base_op) {
+      case kOpLiteral: {
+        switch (BaseOpAt(insn.next)) {
+          case kOpAdd: { insn.op = kOpLitAdd; break; }
+          case kOpSub: { insn.op = kOpLitSub; break; }
+          case kOpMul: { insn.op = kOpLitMul; break; }
+          case kOpDiv: { insn.op = kOpLitDiv; break; }
+          case kOpDropN: { insn.op = kOpLitDropN; break; }
+          case kOpRotate: { insn.op = kOpLitRotate; break; }
+          // A literal destination always resolves the same way, so resolve
+          // it once, here.  Literals don't otherwise use `target`.
+          case kOpCall: {
+            insn.op = kOpLitCall;
+            insn.target = Resolve(global_label_, insn.val);
+            break;
+          }
+          case kOpGoto: {
+            insn.op = kOpLitGoto;
+            insn.target = Resolve(global_label_, insn.val);
+            break;
+          }
+          default: break;
+        }
+        break;
+      }
+
+      case kOpDup: {
+        if (BaseOpAt(loc + 1) == kOpDup && BaseOpAt(loc + 2) == kOpMul) {
+          insn.op = kOpSquare;
+        } else if (BaseOpAt(loc + 1) == kOpIf) {
+          insn.op = kOpDupIf;
+        }
+        break;
+      }
+
+      case kOpSwap: {
+        if (BaseOpAt(loc + 1) == kOpIf) {
+          insn.op = kOpSwapIf;
+        }
+        break;
+      }
+
+      case kOpPrintTop: {
+        if (BaseOpAt(loc + 1) == kOpDrop) {
+          insn.op = kOpPrintDrop;
+        }
+        break;
+      }
+
+      default: break;
+    }
+  }
+}
+
+bool VM::Step() {
   steps_++;
 
-  if (bytecode == '\\') {
-    bytecode = Esc(NextByte());
+  // Fetching outside the program yields `X`, without advancing the PC.
+  if (pc_ < 0 || pc_ >= LocType(prog_.size())) {
+    terminate_ = true;
+    FlushOutput();
+    return terminate_;
   }
 
-  switch (bytecode) {
-    case 'X': {
+  const Insn& insn = code_[pc_];
+  pc_ = insn.next;
+
+  switch (insn.base_op) {
+    case kOpHalt: case kOpStop: {
       terminate_ = true;
       break;
     }
 
-    case '0': case '1': case '2': case '3': case '4':
-    case '5': case '6': case '7': case '8': case '9': case '.': {
-      auto [val, new_loc] = GetNumber(pc_ - 1);
-      pc_ = new_loc;
-      Push(val);
+    case kOpLiteral: { Push(insn.val); break; }
+    case kOpPushVar: { Push(GetV(insn.reg)); break; }
+
+    case kOpAdd: { TwoOp(std::plus()); break; }
+    case kOpSub: { TwoOp(std::minus()); break; }
+    case kOpMul: { TwoOp(std::multiplies()); break; }
+    case kOpDiv: { TwoOp(std::divides()); break; }
+    case kOpNeg: { OneOp(std::negate()); break; }
+    case kOpMod: { TwoOp<DblFxn2>(std::fmod); break; }
+    case kOpAnd: { TwoOpUint(std::bit_and()); break; }
+    case kOpOr: { TwoOpUint(std::bit_or()); break; }
+    case kOpXor: { TwoOpUint(std::bit_xor()); break; }
+    case kOpShl: {
+      OneOp<DblFxn1>(std::exp2);
+      TwoOp(std::multiplies());
       break;
     }
-
-    case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g':
-    case 'h': case 'i': case 'j': case 'k': case 'l': case 'm': case 'n':
-    case 'o': case 'p': case 'q': case 'r': case 's': case 't': case 'u':
-    case 'v': case 'w': case 'x': case 'y': case 'z': {
-      Push(GetV(bytecode));
+    case kOpShr: {
+      OneOp<DblFxn1>(std::exp2);
+      TwoOp(std::divides());
       break;
     }
-
-    case '+': { TwoOp(std::plus()); break; }
-    case '-': { TwoOp(std::minus()); break; }
-    case '*': { TwoOp(std::multiplies()); break; }
-    case '/': { TwoOp(std::divides()); break; }
-    case '~': { OneOp(std::negate()); break; }
-    case '%': { TwoOp<DblFxn2>(std::fmod); break; }
-    case '&': { TwoOpUint(std::bit_and()); break; }
-    case '|': { TwoOpUint(std::bit_or()); break; }
-    case '^': { TwoOpUint(std::bit_xor()); break; }
-    case '<': { OneOp<DblFxn1>(std::exp2); TwoOp(std::multiplies()); break; }
-    case '>': { OneOp<DblFxn1>(std::exp2); TwoOp(std::divides()); break; }
-    case '\'': { PrintLn(Top()); break; }
-    case '!': { PrintLn(GetV(NextByte())); break; }
-    case 'C': { auto dst = Resolve(Pop()); Push(~pc_); pc_ = dst; break; }
-    case 'G': { pc_ = Resolve(Pop()); break; }
-    case 'I': { Top() = Int(Top()); break; }
-    case 'U': { Top() = Uint(Top()); break; }
-    case 'M': { SetV(NextByte(), Pop()); break; }
-    case 'V': { Push(GetV(NextByte())); break; }
-    case 'D': { Push(Top()); break; }
-    case 'P': { Pop(); break; }
-    case 'Q': { DropN(Nat(Pop())); break; }
-    case 'R': { Rotate(Int(Pop())); break; }
-    case 'S': { auto a = Pop(), b = Pop(); Push(a); Push(b); break; }
-    case '?': { if (Pop() < 0) { pc_ = branch_target_[pc_]; } break; }
-    case 'L': case '@': case ':': case 'B': case 'F': case ' ': case ';': {
-      pc_ = branch_target_[pc_]; break;
-    }
+    case kOpPrintTop: { PrintLn(Top(), &insn); break; }
+    case kOpPrintVar: { PrintLn(GetV(insn.reg), &insn); break; }
+    case kOpCall: { auto dst = Resolve(Pop()); Push(~pc_); pc_ = dst; break; }
+    case kOpGoto: { pc_ = Resolve(Pop()); break; }
+    case kOpInt: { Top() = Int(Top()); break; }
+    case kOpUint: { Top() = Uint(Top()); break; }
+    case kOpStore: { SetV(insn.reg, Pop()); break; }
+    case kOpDup: { Push(Top()); break; }
+    case kOpDrop: { Pop(); break; }
+    case kOpDropN: { DropN(Nat(Pop())); break; }
+    case kOpRotate: { Rotate(Int(Pop())); break; }
+    case kOpSwap: { auto a = Pop(), b = Pop(); Push(a); Push(b); break; }
+    case kOpIf: { if (Pop() < 0) { pc_ = insn.target; } break; }
+    case kOpJump: { pc_ = insn.target; break; }
 
     // Library escapes.
-    case Esc('^'): { TwoOp<DblFxn2>(std::pow); break; }
-    case Esc('h'): { TwoOp<DblFxn2>(std::hypot); break; }
-    case Esc('H'): {
+    case kOpEscPow: { TwoOp<DblFxn2>(std::pow); break; }
+    case kOpEscHypot: { TwoOp<DblFxn2>(std::hypot); break; }
+    case kOpEscHypot3: {
       auto x = Pop(), y = Pop();
       Top() = std::hypot(Top(), y, x);
       break;
     }
-    case Esc('a'): { TwoOp<DblFxn2>(std::atan2); break; }
-    case Esc('s'): { OneOp<DblFxn1>(std::sin); break; }
-    case Esc('S'): { OneOp<DblFxn1>(std::asin); break; }
-    case Esc('c'): { OneOp<DblFxn1>(std::cos); break; }
-    case Esc('C'): { OneOp<DblFxn1>(std::acos); break; }
-    case Esc('t'): { OneOp<DblFxn1>(std::tan); break; }
-    case Esc('T'): { OneOp<DblFxn1>(std::atan); break; }
-    case Esc('x'): { OneOp<DblFxn1>(std::sinh); break; }
-    case Esc('X'): { OneOp<DblFxn1>(std::asinh); break; }
-    case Esc('y'): { OneOp<DblFxn1>(std::cosh); break; }
-    case Esc('Y'): { OneOp<DblFxn1>(std::acosh); break; }
-    case Esc('z'): { OneOp<DblFxn1>(std::tanh); break; }
-    case Esc('Z'): { OneOp<DblFxn1>(std::atanh); break; }
-    case Esc('v'): { OneOp<DblFxn1>(std::erf); break; }
-    case Esc('V'): { OneOp<DblFxn1>(std::erfc); break; }
-    case Esc('u'): { OneOp<DblFxn1>(std::tgamma); break; }
-    case Esc('U'): { OneOp<DblFxn1>(std::lgamma); break; }
-    case Esc('e'): { OneOp<DblFxn1>(std::exp); break; }
-    case Esc('l'): { OneOp<DblFxn1>(std::log); break; }
-    case Esc('2'): { OneOp<DblFxn1>(std::log2); break; }
-    case Esc('q'): { OneOp<DblFxn1>(std::sqrt); break; }
-    case Esc('3'): { OneOp<DblFxn1>(std::cbrt); break; }
-    case Esc('>'): { OneOp<DblFxn1>(std::ceil); break; }
-    case Esc('<'): { OneOp<DblFxn1>(std::floor); break; }
-    case Esc('_'): { OneOp<DblFxn1>(std::trunc); break; }
-    case Esc('|'): { OneOp<DblFxn1>(std::abs); break; }
-    case Esc('i'): { OneOp<DblFxn1>(std::round); break; }
-    case Esc('I'): { OneOp<DblFxn1>(std::nearbyint); break; }
-    case Esc('f'): {
+    case kOpEscAtan2: { TwoOp<DblFxn2>(std::atan2); break; }
+    case kOpEscSin: { OneOp<DblFxn1>(std::sin); break; }
+    case kOpEscAsin: { OneOp<DblFxn1>(std::asin); break; }
+    case kOpEscCos: { OneOp<DblFxn1>(std::cos); break; }
+    case kOpEscAcos: { OneOp<DblFxn1>(std::acos); break; }
+    case kOpEscTan: { OneOp<DblFxn1>(std::tan); break; }
+    case kOpEscAtan: { OneOp<DblFxn1>(std::atan); break; }
+    case kOpEscSinh: { OneOp<DblFxn1>(std::sinh); break; }
+    case kOpEscAsinh: { OneOp<DblFxn1>(std::asinh); break; }
+    case kOpEscCosh: { OneOp<DblFxn1>(std::cosh); break; }
+    case kOpEscAcosh: { OneOp<DblFxn1>(std::acosh); break; }
+    case kOpEscTanh: { OneOp<DblFxn1>(std::tanh); break; }
+    case kOpEscAtanh: { OneOp<DblFxn1>(std::atanh); break; }
+    case kOpEscErf: { OneOp<DblFxn1>(std::erf); break; }
+    case kOpEscErfc: { OneOp<DblFxn1>(std::erfc); break; }
+    case kOpEscTgamma: { OneOp<DblFxn1>(std::tgamma); break; }
+    case kOpEscLgamma: { OneOp<DblFxn1>(std::lgamma); break; }
+    case kOpEscExp: { OneOp<DblFxn1>(std::exp); break; }
+    case kOpEscLog: { OneOp<DblFxn1>(std::log); break; }
+    case kOpEscLog2: { OneOp<DblFxn1>(std::log2); break; }
+    case kOpEscSqrt: { OneOp<DblFxn1>(std::sqrt); break; }
+    case kOpEscCbrt: { OneOp<DblFxn1>(std::cbrt); break; }
+    case kOpEscCeil: { OneOp<DblFxn1>(std::ceil); break; }
+    case kOpEscFloor: { OneOp<DblFxn1>(std::floor); break; }
+    case kOpEscTrunc: { OneOp<DblFxn1>(std::trunc); break; }
+    case kOpEscAbs: { OneOp<DblFxn1>(std::abs); break; }
+    case kOpEscRound: { OneOp<DblFxn1>(std::round); break; }
+    case kOpEscNearbyInt: { OneOp<DblFxn1>(std::nearbyint); break; }
+    case kOpEscFrexp: {
       int exp;
       Top() = std::frexp(Top(), &exp);
       Push(exp);
       break;
     }
-    case Esc('F'): { TwoOp<double(double,int)>(std::ldexp); break; }
-    case Esc('m'): {
+    case kOpEscLdexp: { TwoOp<double(double,int)>(std::ldexp); break; }
+    case kOpEscModf: {
       double int_part;
       Top() = std::modf(Top(), &int_part);
       Push(int_part);
       break;
     }
-    case Esc('-'): { OneOp<bool(double)>(std::signbit); break; }
-    case Esc('+'): { TwoOp<DblFxn2>(std::copysign); break; }
+    case kOpEscSignBit: { OneOp<bool(double)>(std::signbit); break; }
+    case kOpEscCopySign: { TwoOp<DblFxn2>(std::copysign); break; }
 
-    default: {
-      std::cout << "Undefined bytecode '" << bytecode << "' at " << pc_ - 1
-                << ". Terminating.\n";
+    case kOpUndefined: {
+      FlushOutput();
+      Messages() << "Undefined bytecode '" << insn.code << "' at "
+                 << pc_ - 1 << ". Terminating.\n";
       terminate_ = true;
+      break;
     }
+
+    // Superinstructions are only ever in `op`, never `base_op`.
+    default: break;
   }
 
+  FlushOutput();
   return terminate_;
 }
 
-static void ShowTopN(const std::vector<VM::ValueType>& stack, int n) {
-  std::size_t first = 0;
-  std::size_t last = stack.size();
-  if (last - first > n) {
-    first = last - n;
+// Loads the stack into registers for a fast run loop.  While the loop runs,
+// the stack lives in the stack memory, from `stack_base_` up to the
+// registers' `sp`, and `stack_` is empty.
+VM::Regs VM::LoadRegs() {
+  const std::size_t depth = stack_.size();
+#if VM_GUARDED_STACK
+  // The stack gets half of the reservation, and needs room for one more.
+  const std::size_t reserve = 2 * (depth + 1) * sizeof(ValueType);
+  if (!stack_mapping_ || stack_mapping_->reserve() < reserve) {
+    stack_mapping_ =
+        std::make_unique<StackMapping>(std::max(reserve, kMinStackReserve));
   }
+  stack_floor_ = stack_mapping_->floor();
+  stack_base_ = stack_mapping_->base();
+  stack_limit_ = stack_mapping_->limit();
+#else
+  stack_mem_.resize(1 + std::max({stack_mem_.size(), depth, kMinStack}));
+  stack_floor_ = stack_base_ = stack_mem_.data() + 1;
+  stack_limit_ = stack_mem_.data() + stack_mem_.size();
+#endif
+  std::copy(stack_.begin(), stack_.end(), stack_base_);
+  stack_.clear();
+  if (depth == 0) {
+    return {stack_base_, 0.};
+  }
+  return {stack_base_ + depth - 1, stack_base_[depth - 1]};
+}
 
-  for (std::size_t i = first; i < last; ++i) {
-    std::cout << ' ' << stack[i];
+// Runs the program with `switch` dispatch.  The PC, stack pointer and TOS
+// stay in locals until the program terminates, so arithmetic works on TOS in
+// a register, and only touches memory when the stack depth changes.  A
+// kLimited run stops early, between instructions, once it reaches
+// `max_steps` in all.  That check costs a little, so plain runs leave it out.
+// So does the check for whether a kSampled run owes a sample.
+template <bool kLimited, bool kSampled>
+void VM::RunSwitch(int64_t max_steps) {
+  Regs r = LoadRegs();
+  const Insn* ip = At(pc_);
+  int64_t steps = steps_;
+
+  for (;;) {
+    if (kLimited && steps >= max_steps && ip->op != kOpStop) {
+      pc_ = ip - code_.data();
+      steps_ = steps;
+      StoreRegs(r);
+      return;
+    }
+#if VM_SAMPLING
+    if (kSampled && sample_due_.load(std::memory_order_relaxed)) {
+      sample_due_.store(false, std::memory_order_relaxed);
+      Sample(ip, r);
+    }
+#endif
+    switch (ip->op) {
+#define VM_OPCODE_CASE(name) \
+      case kOp##name: { \
+        steps += StepsFor(kOp##name); \
+        ip = Execute(kOp##name, ip, r); \
+        continue; \
+      }
+      VM_OPCODES(VM_OPCODE_CASE)
+#undef VM_OPCODE_CASE
+
+      case kOpHalt: {
+        ++steps;
+        pc_ = ip->next;
+        break;
+      }
+      case kOpStop: case kNumOps: break;
+    }
+    break;
   }
+
+  steps_ = steps;
+  StoreRegs(r);
+  terminate_ = true;
 }
 
-}  // namespace
+#if VM_SAMPLING
+// Runs the program in RunSwitch(), while SIGPROF fires at the sampling rate.
+// The signal handler only raises `sample_due_`, and the loop takes the
+// sample itself, between instructions, with the PC and the stack at hand.
+// Checking the flag costs every instruction a load and a branch, so only
+// the kSampled loop does.
+void VM::RunSampled() {
+  // Sets up the timer and the handler for the run, and puts them back after
+  // it, however it ends.
+  class Timer {
+   public:
+    explicit Timer(int hz) {
+      struct sigaction action{};
+      action.sa_handler = [](int) {
+        sample_due_.store(true, std::memory_order_relaxed);
+      };
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGPROF, &action, &old_action_);
+      const long usec = std::max(1000000 / hz, 1);
+      itimerval timer{};
+      timer.it_interval.tv_sec = usec / 1000000;
+      timer.it_interval.tv_usec = usec % 1000000;
+      timer.it_value = timer.it_interval;
+      setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+    ~Timer() {
+      const itimerval off{};
+      setitimer(ITIMER_PROF, &off, nullptr);
+      sigaction(SIGPROF, &old_action_, nullptr);
+      sample_due_.store(false, std::memory_order_relaxed);
+    }
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
 
-int main(int argc, char *argv[]) {
-  std::string prog, line;
+   private:
+    struct sigaction old_action_{};
+  } timer(sample_hz_);
 
-  // Read the program on stdin.
-  while (std::getline(std::cin, line)) {
-    prog += line;
-    prog += ' ';  // Preserve whitespace between lines.
+  RunSwitch<false, true>();
+}
+
+// Takes a sample, with the run at `ip`.  A `C` leaves its return address on
+// the stack, as ~PC, among the program's own values, and nothing else
+// records the call.  So the call chain is a guess: any negative integer
+// that would return just past a `C` counts as a frame, even if the program
+// computed it, or saved it and never returns through it.  A call whose
+// return address the program moved off the stack, such as into a variable,
+// doesn't show.  This walks the whole stack, so each sample costs time in
+// proportion to its depth.
+void VM::Sample(const Insn* ip, const Regs& r) {
+  std::vector<LocType> stack;
+  auto AddCall = [&](ValueType val) {
+    if (val <= -2. && val >= -ValueType(prog_.size()) - 1.) {
+      const LocType ret = ~Int(val);  // 1 .. prog_.size()
+      if (ValueType(~ret) == val && code_[ret - 1].base_op == kOpCall) {
+        stack.push_back(ret - 1);
+      }
+    }
+  };
+  for (const ValueType* item = stack_base_; item != r.sp; ++item) {
+    AddCall(*item);
   }
+  AddCall(r.tos);
+  stack.push_back(ip - code_.data());
+  ++samples_[stack];
+}
 
-  g_debug_branch_opt = argc > 1 && argv[1][0] == 'b';
+void VM::SetSampling(int hz) {
+  sample_hz_ = std::max(hz, 0);
+}
 
-  auto vm = VM(prog);
+void VM::WriteSamples(std::ostream& out) const {
+  // The global labels in program order, to find the one a PC is under.
+  std::vector<std::pair<LocType, ValueType>> labels;
+  LabelTable(global_label_).ForEach([&](ValueType label, LocType pc) {
+    labels.emplace_back(pc, label);
+  });
+  std::sort(labels.begin(), labels.end());
+
+  std::vector<LocType> line_starts = {0};
+  for (LocType loc = 0; loc != LocType(prog_.size()); ++loc) {
+    if (prog_[loc] == '\n') {
+      line_starts.push_back(loc + 1);
+    }
+  }
 
-  if (argc == 1) {
-    vm.Run();
-  } else {
-    bool terminate;
-    do {
-      VM::LocType pc = vm.GetPc();
-      std::cout << "PC=" << pc << " '" << vm.ByteAt(pc) << "' ";
-      ShowTopN(vm.GetStack(), 10);
-      std::cout << '\n';
-      terminate = vm.Step();
-    } while (!terminate);
+  auto Frame = [&](LocType pc) {
+    std::ostringstream frame;
+    const auto label = std::upper_bound(
+        labels.begin(), labels.end(), pc,
+        [](LocType pc, const auto& label) { return pc < label.first; });
+    if (label == labels.begin()) {
+      frame << "main";
+    } else {
+      frame << '@' << std::prev(label)->second;
+    }
+    const auto line =
+        std::upper_bound(line_starts.begin(), line_starts.end(), pc) - 1;
+    frame << ' ' << line - line_starts.begin() + 1 << ':' << pc - *line + 1;
+    return frame.str();
+  };
+
+  for (const auto& [stack, count] : samples_) {
+    for (std::size_t i = 0; i != stack.size(); ++i) {
+      out << (i == 0 ? "" : ";") << Frame(stack[i]);
+    }
+    out << ' ' << count << '\n';
   }
+}
+#else
+void VM::SetSampling(int) {}
+void VM::WriteSamples(std::ostream&) const {}
+#endif  // VM_SAMPLING
+
+#if VM_PROFILE
+// Reads the CPU's time stamp counter, or a nanosecond clock on CPUs that
+// don't have one.
+std::uint64_t VM::ReadCycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
 
-  std::cout << "DONE.  " << vm.GetSteps() << " steps\n";
+// Runs the program as RunSwitch() does, while counting each instruction's
+// runs and timing each run, into `profile_`.  Instructions run as the fast
+// run loops run them, superinstructions and all, so a fused `'P` counts as
+// one run of `'`, as PrintDrop.  A `C` gets the cycles for finding its
+// destination, and not the ones for what it calls.
+void VM::RunProfiled() {
+  if (profile_.empty()) {
+    profile_.resize(code_.size());
+  }
+  Regs r = LoadRegs();
+  const Insn* ip = At(pc_);
+  int64_t steps = steps_;
+
+  while (ip->op != kOpHalt && ip->op != kOpStop) {
+    auto& profile = profile_[ip - code_.data()];
+    const Op op = ip->op;
+    const auto start = ReadCycles();
+    ip = Execute(op, ip, r);
+    profile.cycles += ReadCycles() - start;
+    ++profile.runs;
+    steps += StepsFor(op);
+  }
+  if (ip->op == kOpHalt) {
+    ++steps;
+    pc_ = ip->next;
+  }
+
+  steps_ = steps;
+  StoreRegs(r);
+  terminate_ = true;
+}
+
+void VM::ShowProfile(std::ostream& out) const {
+  static const char* const kOpNames[kNumOps] = {
+    "Halt", "Stop",
+#define VM_OPCODE_NAME(name) #name,
+    VM_OPCODES(VM_OPCODE_NAME)
+#undef VM_OPCODE_NAME
+  };
+
+  // Reading the clock takes time of its own, which every run pays once.
+  // Take the quickest of a few back-to-back reads as that cost, and leave it
+  // out of each run.
+  std::uint64_t overhead = std::numeric_limits<std::uint64_t>::max();
+  for (int i = 0; i != 1000; ++i) {
+    const auto start = ReadCycles();
+    overhead = std::min(overhead, ReadCycles() - start);
+  }
+
+  struct Row {
+    std::string bytecode;
+    Op op;
+    int64_t runs = 0;
+    std::uint64_t cycles = 0;
+  };
+  std::map<std::pair<std::string, Op>, Row> by_key;
+  int64_t total_runs = 0;
+  std::uint64_t total_cycles = 0;
+  for (LocType loc = 0; loc < LocType(profile_.size()); ++loc) {
+    const auto& profile = profile_[loc];
+    if (profile.runs == 0) {
+      continue;
+    }
+    const Insn& insn = code_[loc];
+    std::string bytecode =
+        insn.base_op == kOpLiteral ? "0-9"
+        : insn.code > kByteMax ? std::string{'\\', char(insn.code - Esc(0))}
+        : std::string(1, char(insn.code));
+    const auto cycles =
+        profile.cycles - std::min(profile.cycles, profile.runs * overhead);
+    auto& row = by_key[{bytecode, insn.op}];
+    row.bytecode = std::move(bytecode);
+    row.op = insn.op;
+    row.runs += profile.runs;
+    row.cycles += cycles;
+    total_runs += profile.runs;
+    total_cycles += cycles;
+  }
+  if (total_runs == 0) {
+    return;
+  }
+
+  std::vector<Row> rows;
+  for (auto& [key, row] : by_key) {
+    rows.push_back(std::move(row));
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+    return a.cycles != b.cycles ? a.cycles > b.cycles : a.runs > b.runs;
+  });
+
+  out << "Profile: " << total_runs << " runs, " << total_cycles
+      << " cycles, less " << overhead << " per run for timing\n"
+      << "bytecode  opcode              runs        steps       cycles"
+      << "  cycles%  per run\n";
+  const auto flags = out.flags();
+  const auto precision = out.precision();
+  out << std::fixed << std::setprecision(1);
+  for (const auto& row : rows) {
+    out << "'" << row.bytecode << "'" << std::setw(8 - row.bytecode.size())
+        << "" << std::left << std::setw(12) << kOpNames[row.op]
+        << std::right << std::setw(12) << row.runs << std::setw(13)
+        << row.runs * StepsFor(row.op) << std::setw(13) << row.cycles
+        << std::setw(9) << 100. * row.cycles / total_cycles << std::setw(9)
+        << double(row.cycles) / row.runs << '\n';
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
+#endif  // VM_PROFILE
+
+#if VM_THREADED_DISPATCH
+// Runs the program with direct-threaded dispatch.  Each opcode's handler
+// jumps straight to the next handler through its own indirect branch, which
+// gives the branch predictor one branch per opcode to learn, rather than a
+// single shared branch at the top of a `switch`.  The PC, stack pointer and
+// TOS stay in locals until the program terminates.
+void VM::RunThreaded() {
+  static const void* const kDispatch[kNumOps] = {
+    &&op_Halt, &&op_Stop,
+#define VM_OPCODE_LABEL(name) &&op_##name,
+    VM_OPCODES(VM_OPCODE_LABEL)
+#undef VM_OPCODE_LABEL
+  };
+
+  Regs r = LoadRegs();
+  const Insn* ip = At(pc_);
+  int64_t steps = steps_;
+
+#define VM_DISPATCH() goto *kDispatch[ip->op]
+
+  VM_DISPATCH();
+
+#define VM_OPCODE_HANDLER(name) \
+  op_##name: \
+    steps += StepsFor(kOp##name); \
+    ip = Execute(kOp##name, ip, r); \
+    VM_DISPATCH();
+  VM_OPCODES(VM_OPCODE_HANDLER)
+#undef VM_OPCODE_HANDLER
+#undef VM_DISPATCH
+
+op_Halt:
+  ++steps;
+  pc_ = ip->next;
+op_Stop:
+  steps_ = steps;
+  StoreRegs(r);
+  terminate_ = true;
+}
+#endif  // VM_THREADED_DISPATCH
+
+#if VM_TAILCALL_DISPATCH
+// Each handler runs one opcode, and then passes control to the next opcode's
+// handler.  With [[clang::musttail]], that's a guaranteed tail call, so the
+// handlers chain together without growing the C++ stack.  Otherwise, the
+// handler parks the machine state in `bounce_` and returns to the trampoline
+// in RunTailCall().
+#ifdef VM_MUSTTAIL
+#define VM_TAIL_DISPATCH(vm, ip, r, steps) \
+  VM_MUSTTAIL return kTailCalls[(ip)->op](vm, ip, (r).sp, (r).tos, steps)
+#else
+#define VM_TAIL_DISPATCH(vm, ip, r, steps) \
+  do { (vm)->bounce_ = {ip, r, steps}; return; } while (false)
+#endif
+
+template <VM::Op op>
+void VM::TailCall(VM* vm, const Insn* ip, ValueType* sp, ValueType tos,
+                  int64_t steps) {
+  Regs r{sp, tos};
+  ip = vm->Execute(op, ip, r);
+  VM_TAIL_DISPATCH(vm, ip, r, steps + StepsFor(op));
+}
+
+template <>
+void VM::TailCall<VM::kOpHalt>(VM* vm, const Insn* ip, ValueType* sp,
+                               ValueType tos, int64_t steps) {
+  vm->pc_ = ip->next;
+  TailCallFinish(vm, ip, sp, tos, steps + 1);
+}
+
+template <>
+void VM::TailCall<VM::kOpStop>(VM* vm, const Insn* ip, ValueType* sp,
+                               ValueType tos, int64_t steps) {
+  TailCallFinish(vm, ip, sp, tos, steps);
+}
+
+#undef VM_TAIL_DISPATCH
+
+// Writes the machine state back to the VM once the program terminates.
+void VM::TailCallFinish(VM* vm, const Insn*, ValueType* sp, ValueType tos,
+                        int64_t steps) {
+  vm->steps_ = steps;
+  vm->StoreRegs({sp, tos});
+  vm->terminate_ = true;
+}
+
+VM::TailCallFxn* const VM::kTailCalls[VM::kNumOps] = {
+  &TailCall<kOpHalt>, &TailCall<kOpStop>,
+#define VM_OPCODE_TAILCALL(name) &TailCall<kOp##name>,
+  VM_OPCODES(VM_OPCODE_TAILCALL)
+#undef VM_OPCODE_TAILCALL
+};
+
+// Runs the program with tail-call dispatch.
+void VM::RunTailCall() {
+  const Regs r = LoadRegs();
+  const Insn* const ip = At(pc_);
+  terminate_ = false;
+#ifdef VM_MUSTTAIL
+  kTailCalls[ip->op](this, ip, r.sp, r.tos, steps_);
+#else
+  bounce_ = {ip, r, steps_};
+  while (!terminate_) {
+    kTailCalls[bounce_.ip->op](this, bounce_.ip, bounce_.r.sp, bounce_.r.tos,
+                               bounce_.steps);
+  }
+#endif
+}
+#endif  // VM_TAILCALL_DISPATCH
+
+// SPMD batch mode.  Batch runs the program over up to kLanes inputs at once,
+// one per lane.  Each lane has its own stack and variables: the stack is an
+// array of slots, each holding one value per lane, and so is the variable
+// file.  Lanes that take the same path through the program share one
+// instruction stream.  The lane-wise loops below are plain loops, which the
+// compiler vectorizes where it can; there are no hand-written SIMD kernels.
+// Escapes that call the math library call it once per lane.
+//
+// Lanes at the same PC travel together as a Group, with a mask of the lanes
+// it holds.  A `?`, `C` or `G` whose lanes disagree splits its group, one
+// group per destination.  Groups rejoin when they reach the same PC: Run()
+// always runs the group furthest behind in the program, and hands over to
+// another group as soon as it catches up with it or passes it, so lanes
+// that split at an if-then-else or a loop exit meet again at the code that
+// follows.  A group only writes its own lanes, so groups can share the
+// stack and variables.
+//
+// Groups that meet can have different stack depths.  The stack behaves as
+// if there's an infinite well of 0s beneath it, so padding the shallower
+// group's stacks with 0s at the bottom doesn't change what its lanes see,
+// and brings both groups to the same depth.  The same goes for `Q` and `R`
+// with counts that differ between lanes.
+class VM::Batch {
+ public:
+  static constexpr int kLanes = 8;
+
+  explicit Batch(VM& vm) : vm_(vm) {}
+
+  // Runs the program over `count` inputs, from `inputs` on.  Each input is
+  // pushed onto its lane's stack, in order, before the program starts.
+  void Run(const std::vector<ValueType>* inputs, int count);
+
+  // Gets the output and step count of a lane of the last Run().
+  const std::string& GetOutput(int lane) const { return output_[lane]; }
+  int64_t GetSteps(int lane) const { return steps_[lane]; }
+
+ private:
+  using Mask = std::uint32_t;
+  static constexpr Mask kAllLanes = (Mask(1) << kLanes) - 1;
+
+  struct alignas(64) Lanes {
+    ValueType v[kLanes];
+  };
+
+  struct Group {
+    const Insn* ip;
+    std::size_t sp;  // Stack depth.  The top of stack is stack_[sp].
+    Mask mask;
+    int64_t steps;   // Steps not yet added into steps_.
+  };
+
+  static Lanes Broadcast(ValueType val) {
+    Lanes lanes;
+    std::fill(std::begin(lanes.v), std::end(lanes.v), val);
+    return lanes;
+  }
+
+  template <typename Callable>
+  static Lanes Map(const Lanes& a, Callable fxn) {
+    Lanes lanes;
+    for (int l = 0; l != kLanes; ++l) {
+      lanes.v[l] = fxn(a.v[l]);
+    }
+    return lanes;
+  }
+
+  template <typename Callable>
+  static Lanes Map(const Lanes& a, const Lanes& b, Callable fxn) {
+    Lanes lanes;
+    for (int l = 0; l != kLanes; ++l) {
+      lanes.v[l] = fxn(a.v[l], b.v[l]);
+    }
+    return lanes;
+  }
+
+  // Stores the lanes in `mask` from `src` into `dst`.
+  static void Store(Lanes& dst, const Lanes& src, Mask mask) {
+    if (mask == kAllLanes) {
+      dst = src;
+      return;
+    }
+    for (int l = 0; l != kLanes; ++l) {
+      dst.v[l] = (mask >> l & 1) ? src.v[l] : dst.v[l];
+    }
+  }
+
+  // Makes sure stack_[slot] exists.  This invalidates references into it.
+  void Reserve(std::size_t slot) {
+    if (slot >= stack_.size()) {
+      stack_.resize(std::max(slot + 1, stack_.size() * 2));
+    }
+  }
+
+  void Push(Group& g, const Lanes& val) {
+    Reserve(++g.sp);
+    Store(stack_[g.sp], val, g.mask);
+  }
+
+  // Pops the top of stack.  stack_[0] is all 0s, for an empty stack.
+  Lanes Pop(Group& g) {
+    const Lanes val = stack_[g.sp];
+    g.sp -= g.sp != 0;
+    return val;
+  }
+
+  // Returns a reference to the top of stack, pushing a 0 if it's empty, as
+  // in VM::Top().  Only Store() to it.
+  Lanes& Top(Group& g) {
+    if (g.sp == 0) {
+      Push(g, Lanes{});
+    }
+    return stack_[g.sp];
+  }
+
+  template <typename Callable>
+  void OneOp(Group& g, Callable fxn) {
+    Lanes& top = Top(g);
+    Store(top, Map(top, fxn), g.mask);
+  }
+
+  template <typename Callable>
+  void TwoOp(Group& g, Callable fxn) {
+    const Lanes rhs = Pop(g);
+    Lanes& top = Top(g);
+    Store(top, Map(top, rhs, fxn), g.mask);
+  }
+
+  template <typename Callable>
+  void TwoOpUint(Group& g, Callable fxn) {
+    TwoOp(g, [fxn](ValueType a, ValueType b) {
+      return ValueType(fxn(Uint(a), Uint(b)));
+    });
+  }
+
+  void PrintLn(const Lanes& val, Mask mask);
+  void MoveSlots(std::size_t from, std::size_t to, std::size_t count,
+                 Mask mask);
+  void Pad(Group& g, std::size_t sp);
+  void DropN(Group& g, int64_t n);
+  void Rotate(Group& g, int64_t n);
+  template <typename Fxn>
+  void ForEachValue(const Lanes& val, Mask mask, Fxn fxn);
+  void Diverge(Group& g, const std::vector<std::pair<Mask, const Insn*>>&
+                             dsts);
+  void Flush(Group& g);
+  void Merge(Group& g, Group& other);
+  void Run(Group g);
+
+  VM& vm_;
+  std::vector<Lanes> stack_{};
+  std::array<Lanes, kByteMax + 1> var_{};
+  std::vector<Group> groups_{};  // Groups waiting to run.
+  std::vector<Group> parts_{};   // Scratch for `Q` and `R`.
+  const Insn* stop_ = nullptr;   // The first instruction of groups_.
+  std::array<std::string, kLanes> output_{};
+  std::array<int64_t, kLanes> steps_{};
+};
+
+// Prints a value per lane, as VM::PrintLn().
+void VM::Batch::PrintLn(const Lanes& val, Mask mask) {
+  for (int l = 0; l != kLanes; ++l) {
+    if (mask >> l & 1) {
+      char text[kMaxFormatLn];
+      output_[l].append(text, FormatLn(text, val.v[l]));
+    }
+  }
+}
+
+// Moves `count` slots of the lanes in `mask`, from stack_[from] on to
+// stack_[to] on.  The slots may overlap.
+void VM::Batch::MoveSlots(std::size_t from, std::size_t to,
+                          std::size_t count, Mask mask) {
+  Reserve(to + count);
+  if (to > from) {
+    for (std::size_t i = count; i-- != 0;) {
+      Store(stack_[to + i], stack_[from + i], mask);
+    }
+  } else {
+    for (std::size_t i = 0; i != count; ++i) {
+      Store(stack_[to + i], stack_[from + i], mask);
+    }
+  }
+}
+
+// Deepens a group's stack to `sp`, by sliding it up and filling the bottom
+// with 0s.
+void VM::Batch::Pad(Group& g, std::size_t sp) {
+  if (sp <= g.sp) {
+    return;
+  }
+  const std::size_t pad = sp - g.sp;
+  MoveSlots(1, 1 + pad, g.sp, g.mask);
+  for (std::size_t slot = 1; slot <= pad; ++slot) {
+    Store(stack_[slot], Lanes{}, g.mask);
+  }
+  g.sp = sp;
+}
+
+// As VM::DropN(), for the same `n` in every lane of the group.
+void VM::Batch::DropN(Group& g, int64_t n) {
+  if (n > 0) {
+    g.sp -= std::min(std::size_t(n), g.sp);
+  }
+}
+
+// As VM::Rotate(), for the same `n` in every lane of the group.
+void VM::Batch::Rotate(Group& g, int64_t n) {
+  if (n < 0) {
+    const Lanes old_tos = Pop(g);
+    const auto pn = uint64_t(0) - uint64_t(n);
+    if (pn > g.sp) {
+      Pad(g, pn);
+    }
+    const std::size_t ins = g.sp + 1 - pn;
+    MoveSlots(ins, ins + 1, pn, g.mask);
+    Store(stack_[ins], old_tos, g.mask);
+    ++g.sp;
+  } else if (uint64_t(n) >= g.sp) {
+    Push(g, Lanes{});
+  } else if (n > 0) {
+    const std::size_t src = g.sp - n;
+    const Lanes val = stack_[src];
+    MoveSlots(src + 1, src, n, g.mask);
+    Store(stack_[g.sp], val, g.mask);
+  }
+}
+
+// Calls `fxn(lanes, value)` for each distinct value among the lanes of
+// `val` in `mask`, where `lanes` is the mask of the lanes with that value.
+template <typename Fxn>
+void VM::Batch::ForEachValue(const Lanes& val, Mask mask, Fxn fxn) {
+  while (mask != 0) {
+    const ValueType first = val.v[__builtin_ctz(mask)];
+    Mask same = 0;
+    for (int l = 0; l != kLanes; ++l) {
+      same |= Mask(val.v[l] == first || (val.v[l] != val.v[l] &&
+                                         first != first)) << l;
+    }
+    same &= mask;
+    fxn(same, first);
+    mask &= ~same;
+  }
+}
+
+// Sends each of the group's lanes to its own destination.  `dsts` pairs
+// lane masks with destinations, and covers the group's lanes.  The group
+// keeps the first destination, and the rest become new groups.
+void VM::Batch::Diverge(
+    Group& g, const std::vector<std::pair<Mask, const Insn*>>& dsts) {
+  if (dsts.size() == 1) {
+    g.ip = dsts[0].second;
+    return;
+  }
+  Flush(g);
+  for (std::size_t i = 1; i != dsts.size(); ++i) {
+    groups_.push_back({dsts[i].second, g.sp, dsts[i].first, 0});
+    stop_ = std::min(stop_, dsts[i].second);
+  }
+  g.mask = dsts[0].first;
+  g.ip = dsts[0].second;
+}
+
+// Adds the group's steps into its lanes' step counts.
+void VM::Batch::Flush(Group& g) {
+  for (int l = 0; l != kLanes; ++l) {
+    steps_[l] += (g.mask >> l & 1) ? g.steps : 0;
+  }
+  g.steps = 0;
+}
+
+// Merges `other` into `g`.  They must be at the same instruction.
+void VM::Batch::Merge(Group& g, Group& other) {
+  Flush(g);
+  Flush(other);
+  Pad(g, other.sp);
+  Pad(other, g.sp);
+  g.mask |= other.mask;
+}
+
+void VM::Batch::Run(const std::vector<ValueType>* inputs, int count) {
+  std::size_t depth = 0;
+  for (int l = 0; l != count; ++l) {
+    depth = std::max(depth, inputs[l].size());
+  }
+  stack_.assign(std::max(depth + 1, kMinStack), Lanes{});
+  var_.fill(Lanes{});
+  output_.fill({});
+  steps_.fill(0);
+  // Shorter inputs go on top of 0s, as Pad() would do.
+  for (int l = 0; l != count; ++l) {
+    const std::size_t pad = depth - inputs[l].size();
+    for (std::size_t i = 0; i != inputs[l].size(); ++i) {
+      stack_[1 + pad + i].v[l] = inputs[l][i];
+    }
+  }
+
+  groups_.assign(1, {vm_.At(vm_.pc_), depth, kAllLanes >> (kLanes - count),
+                     0});
+  while (!groups_.empty()) {
+    // Run the group furthest behind, with any others at the same place.
+    auto first = std::min_element(
+        groups_.begin(), groups_.end(),
+        [](const Group& a, const Group& b) { return a.ip < b.ip; });
+    Group g = *first;
+    groups_.erase(first);
+    for (auto it = groups_.begin(); it != groups_.end();) {
+      if (it->ip == g.ip) {
+        Merge(g, *it);
+        it = groups_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    Run(g);
+  }
+}
+
+// Runs a group until it terminates, or until it reaches or passes another
+// group, when it goes back into groups_.  This mirrors the `switch` in
+// Step().
+void VM::Batch::Run(Group g) {
+  stop_ = vm_.code_.data() + vm_.code_.size();
+  for (const Group& other : groups_) {
+    stop_ = std::min(stop_, other.ip);
+  }
+
+  std::vector<std::pair<Mask, const Insn*>> dsts;
+  for (;;) {
+    if (g.ip >= stop_) {
+      groups_.push_back(g);
+      return;
+    }
+    const Insn* const ip = g.ip;
+    g.ip = vm_.At(ip->next);
+    ++g.steps;
+
+    switch (ip->base_op) {
+      case kOpHalt: case kOpStop: {
+        g.steps -= ip->base_op == kOpStop;
+        Flush(g);
+        return;
+      }
+
+      case kOpLiteral: { Push(g, Broadcast(ip->val)); break; }
+      case kOpPushVar: { Push(g, var_[ip->reg]); break; }
+
+      case kOpAdd: { TwoOp(g, std::plus()); break; }
+      case kOpSub: { TwoOp(g, std::minus()); break; }
+      case kOpMul: { TwoOp(g, std::multiplies()); break; }
+      case kOpDiv: { TwoOp(g, std::divides()); break; }
+      case kOpNeg: { OneOp(g, std::negate()); break; }
+      case kOpMod: { TwoOp<DblFxn2>(g, std::fmod); break; }
+      case kOpAnd: { TwoOpUint(g, std::bit_and()); break; }
+      case kOpOr: { TwoOpUint(g, std::bit_or()); break; }
+      case kOpXor: { TwoOpUint(g, std::bit_xor()); break; }
+      case kOpShl: {
+        OneOp<DblFxn1>(g, std::exp2);
+        TwoOp(g, std::multiplies());
+        break;
+      }
+      case kOpShr: {
+        OneOp<DblFxn1>(g, std::exp2);
+        TwoOp(g, std::divides());
+        break;
+      }
+      case kOpPrintTop: { PrintLn(Top(g), g.mask); break; }
+      case kOpPrintVar: { PrintLn(var_[ip->reg], g.mask); break; }
+      case kOpCall: case kOpGoto: {
+        const Lanes dst = Pop(g);
+        if (ip->base_op == kOpCall) {
+          Push(g, Broadcast(~ip->next));
+        }
+        dsts.clear();
+        ForEachValue(dst, g.mask, [&](Mask lanes, ValueType val) {
+          const Insn* const to = vm_.At(
+              vm_.Resolve(val, vm_.call_cache_[ip->target]));
+          for (auto& [mask, insn] : dsts) {
+            if (insn == to) {
+              mask |= lanes;
+              return;
+            }
+          }
+          dsts.emplace_back(lanes, to);
+        });
+        Diverge(g, dsts);
+        break;
+      }
+      case kOpInt: { OneOp(g, [](ValueType v) { return Int(v); }); break; }
+      case kOpUint: { OneOp(g, [](ValueType v) { return Uint(v); }); break; }
+      case kOpStore: { Store(var_[ip->reg], Pop(g), g.mask); break; }
+      case kOpDup: { Push(g, Lanes(Top(g))); break; }
+      case kOpDrop: { Pop(g); break; }
+      case kOpDropN: case kOpRotate: {
+        // Each count moves its own lanes' stacks.  Then they all get padded
+        // to the same depth.
+        const Lanes n = Pop(g);
+        parts_.clear();
+        ForEachValue(n, g.mask, [&](Mask mask, ValueType val) {
+          Group part{g.ip, g.sp, mask, 0};
+          if (ip->base_op == kOpDropN) {
+            DropN(part, Nat(val));
+          } else {
+            Rotate(part, Int(val));
+          }
+          parts_.push_back(part);
+        });
+        g.sp = 0;
+        for (const Group& part : parts_) {
+          g.sp = std::max(g.sp, part.sp);
+        }
+        for (Group& part : parts_) {
+          Pad(part, g.sp);
+        }
+        break;
+      }
+      case kOpSwap: {
+        const Lanes a = Pop(g), b = Pop(g);
+        Push(g, a);
+        Push(g, b);
+        break;
+      }
+      case kOpIf: {
+        const Lanes val = Pop(g);
+        Mask taken = 0;
+        for (int l = 0; l != kLanes; ++l) {
+          taken |= Mask(val.v[l] < 0) << l;
+        }
+        taken &= g.mask;
+        dsts.clear();
+        if (taken != 0) {
+          dsts.emplace_back(taken, vm_.At(ip->target));
+        }
+        if (taken != g.mask) {
+          dsts.emplace_back(g.mask & ~taken, g.ip);
+        }
+        Diverge(g, dsts);
+        break;
+      }
+      case kOpJump: { g.ip = vm_.At(ip->target); break; }
+
+      // Library escapes.  The rounding and sign escapes vectorize, while the
+      // rest call libm once per lane, so the results match the scalar VM's
+      // bit for bit.
+      case kOpEscPow: { TwoOp<DblFxn2>(g, std::pow); break; }
+      case kOpEscHypot: { TwoOp<DblFxn2>(g, std::hypot); break; }
+      case kOpEscHypot3: {
+        const Lanes x = Pop(g), y = Pop(g);
+        Lanes& top = Top(g);
+        Lanes val;
+        for (int l = 0; l != kLanes; ++l) {
+          val.v[l] = std::hypot(top.v[l], y.v[l], x.v[l]);
+        }
+        Store(top, val, g.mask);
+        break;
+      }
+      case kOpEscAtan2: { TwoOp<DblFxn2>(g, std::atan2); break; }
+      case kOpEscSin: { OneOp<DblFxn1>(g, std::sin); break; }
+      case kOpEscAsin: { OneOp<DblFxn1>(g, std::asin); break; }
+      case kOpEscCos: { OneOp<DblFxn1>(g, std::cos); break; }
+      case kOpEscAcos: { OneOp<DblFxn1>(g, std::acos); break; }
+      case kOpEscTan: { OneOp<DblFxn1>(g, std::tan); break; }
+      case kOpEscAtan: { OneOp<DblFxn1>(g, std::atan); break; }
+      case kOpEscSinh: { OneOp<DblFxn1>(g, std::sinh); break; }
+      case kOpEscAsinh: { OneOp<DblFxn1>(g, std::asinh); break; }
+      case kOpEscCosh: { OneOp<DblFxn1>(g, std::cosh); break; }
+      case kOpEscAcosh: { OneOp<DblFxn1>(g, std::acosh); break; }
+      case kOpEscTanh: { OneOp<DblFxn1>(g, std::tanh); break; }
+      case kOpEscAtanh: { OneOp<DblFxn1>(g, std::atanh); break; }
+      case kOpEscErf: { OneOp<DblFxn1>(g, std::erf); break; }
+      case kOpEscErfc: { OneOp<DblFxn1>(g, std::erfc); break; }
+      case kOpEscTgamma: { OneOp<DblFxn1>(g, std::tgamma); break; }
+      case kOpEscLgamma: { OneOp<DblFxn1>(g, std::lgamma); break; }
+      case kOpEscExp: { OneOp<DblFxn1>(g, std::exp); break; }
+      case kOpEscLog: { OneOp<DblFxn1>(g, std::log); break; }
+      case kOpEscLog2: { OneOp<DblFxn1>(g, std::log2); break; }
+      case kOpEscSqrt: {
+        OneOp(g, [](ValueType v) { return std::sqrt(v); });
+        break;
+      }
+      case kOpEscCbrt: { OneOp<DblFxn1>(g, std::cbrt); break; }
+      case kOpEscCeil: {
+        OneOp(g, [](ValueType v) { return std::ceil(v); });
+        break;
+      }
+      case kOpEscFloor: {
+        OneOp(g, [](ValueType v) { return std::floor(v); });
+        break;
+      }
+      case kOpEscTrunc: {
+        OneOp(g, [](ValueType v) { return std::trunc(v); });
+        break;
+      }
+      case kOpEscAbs: {
+        OneOp(g, [](ValueType v) { return std::abs(v); });
+        break;
+      }
+      case kOpEscRound: { OneOp<DblFxn1>(g, std::round); break; }
+      case kOpEscNearbyInt: { OneOp<DblFxn1>(g, std::nearbyint); break; }
+      case kOpEscFrexp: {
+        Lanes& top = Top(g);
+        Lanes frac, exp;
+        for (int l = 0; l != kLanes; ++l) {
+          int e;
+          frac.v[l] = std::frexp(top.v[l], &e);
+          exp.v[l] = e;
+        }
+        Store(top, frac, g.mask);
+        Push(g, exp);
+        break;
+      }
+      case kOpEscLdexp: {
+        TwoOp<double(double,int)>(g, std::ldexp);
+        break;
+      }
+      case kOpEscModf: {
+        Lanes& top = Top(g);
+        Lanes frac, int_part;
+        for (int l = 0; l != kLanes; ++l) {
+          frac.v[l] = std::modf(top.v[l], &int_part.v[l]);
+        }
+        Store(top, frac, g.mask);
+        Push(g, int_part);
+        break;
+      }
+      case kOpEscSignBit: {
+        OneOp(g, [](ValueType v) { return ValueType(std::signbit(v)); });
+        break;
+      }
+      case kOpEscCopySign: {
+        TwoOp(g, [](ValueType a, ValueType b) { return std::copysign(a, b); });
+        break;
+      }
+
+      case kOpUndefined: {
+        for (int l = 0; l != kLanes; ++l) {
+          if (g.mask >> l & 1) {
+            output_[l] += "Undefined bytecode '" + std::to_string(ip->code) +
+                          "' at " + std::to_string(ip->next - 1) +
+                          ". Terminating.\n";
+          }
+        }
+        Flush(g);
+        return;
+      }
+
+      // Superinstructions are only ever in `op`, never `base_op`.
+      default: break;
+    }
+  }
+}
+
+void VM::RunBatch(const std::vector<std::vector<ValueType>>& inputs) {
+  Batch batch(*this);
+  for (std::size_t first = 0; first < inputs.size();
+       first += Batch::kLanes) {
+    const int count = std::min<std::size_t>(Batch::kLanes,
+                                            inputs.size() - first);
+    batch.Run(&inputs[first], count);
+    for (int lane = 0; lane != count; ++lane) {
+      *out_ << batch.GetOutput(lane) << "DONE.  " << batch.GetSteps(lane)
+            << " steps\n";
+    }
+  }
+}
+
+VM::~VM() {
+  FlushOutput();
+}
+
+}  // namespace simplevm::internal
+
+namespace {
+
+using simplevm::internal::g_debug_branch_opt;
+using simplevm::internal::VM;
+using std::int64_t;
+
+// Reads a program.  Line breaks count as whitespace, but stay in the text,
+// so samples can give each PC's line and column.
+static std::string ReadProgram(std::istream& in) {
+  std::string prog, line;
+  while (std::getline(in, line)) {
+    prog += line;
+    prog += '\n';  // Ends the last line too, as a file's text usually does.
+  }
+  return prog;
+}
+
+#if !VM_COMPILER && !VM_LIBRARY
+// Reads a batch of inputs, one run's per line.
+static std::vector<std::vector<VM::ValueType>> ReadInputs(std::istream& in) {
+  std::vector<std::vector<VM::ValueType>> inputs;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream values(line);
+    inputs.emplace_back(std::istream_iterator<VM::ValueType>(values),
+                        std::istream_iterator<VM::ValueType>());
+  }
+  return inputs;
+}
+#endif
+
+#if !VM_COMPILER && !VM_BATCH && !VM_LIBRARY
+static void ShowTopN(const std::vector<VM::ValueType>& stack, int n) {
+  std::size_t first = 0;
+  std::size_t last = stack.size();
+  if (last - first > std::size_t(n)) {
+    first = last - n;
+  }
+
+  for (std::size_t i = first; i < last; ++i) {
+    std::cout << ' ' << stack[i];
+  }
+}
+
+// Shows the hit rates of the inline caches that saw any labels.
+static void ShowCallCaches(const VM& vm) {
+  int64_t hits = 0, misses = 0;
+  for (const auto& cache : vm.GetCallCaches()) {
+    const int64_t lookups = cache.hits + cache.misses;
+    if (lookups != 0) {
+      std::cout << "'" << vm.ByteAt(cache.loc) << "' at " << cache.loc << ": "
+                << cache.hits << " hits, " << cache.misses << " misses, "
+                << 100. * cache.hits / lookups << "% hit rate\n";
+    }
+    hits += cache.hits;
+    misses += cache.misses;
+  }
+  if (hits + misses != 0) {
+    std::cout << "Inline caches: " << hits << " hits, " << misses
+              << " misses, " << 100. * hits / (hits + misses)
+              << "% hit rate\n";
+  }
+}
+#endif
+
+#if VM_BATCH
+// Runs jobs 0 .. N-1 on a pool of threads.  Each worker has a deque of jobs,
+// dealt out in contiguous runs.  A worker takes jobs from the front of its
+// own deque, in order, and when that runs dry, steals from the back of
+// another worker's, so the workers stay busy however long each job takes.
+// The jobs are whole runs of the VM, so a lock per deque costs nothing next
+// to them.
+class WorkStealingPool {
+ public:
+  WorkStealingPool(std::size_t jobs, int threads) : queues_(threads) {
+    for (int worker = 0; worker != threads; ++worker) {
+      for (std::size_t job = jobs * worker / threads;
+           job != jobs * (worker + 1) / threads; ++job) {
+        queues_[worker].jobs.push_back(job);
+      }
+    }
+  }
+
+  // Calls `fxn(worker, job)` for every job, and returns when they're done.
+  template <typename Fxn>
+  void Run(Fxn fxn) {
+    std::vector<std::thread> threads;
+    for (int worker = 0; worker != int(queues_.size()); ++worker) {
+      threads.emplace_back([this, worker, &fxn] {
+        std::size_t job;
+        while (Take(worker, job)) {
+          fxn(worker, job);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::size_t> jobs;
+  };
+
+  // Takes the next job for a worker.  Returns false when there are none
+  // left anywhere.  No jobs are added once the workers start, so that means
+  // the worker is done.
+  bool Take(int worker, std::size_t& job) {
+    const int threads = queues_.size();
+    for (int i = 0; i != threads; ++i) {
+      Queue& queue = queues_[(worker + i) % threads];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.jobs.empty()) {
+        if (i == 0) {
+          job = queue.jobs.front();
+          queue.jobs.pop_front();
+        } else {
+          job = queue.jobs.back();
+          queue.jobs.pop_back();
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<Queue> queues_;
+};
+#endif  // VM_BATCH
+
+}  // namespace
+
+#if VM_LIBRARY
+namespace simplevm {
+
+struct Program::Impl {
+  explicit Impl(std::string_view source) : program(source) {}
+
+  const VM::Program program;
+};
+
+Program::Program(std::string_view source)
+    : impl_(std::make_shared<const Impl>(source)) {}
+
+Program Program::Read(std::istream& in) {
+  return Program(ReadProgram(in));
+}
+
+struct Machine::Impl {
+  // Appends everything written to it to a caller's string.
+  class StringBuf : public std::streambuf {
+   public:
+    void Set(std::string* str) {
+      str_ = str;
+    }
+
+   protected:
+    int_type overflow(int_type ch) override {
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        str_->push_back(traits_type::to_char_type(ch));
+      }
+      return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+      str_->append(s, n);
+      return n;
+    }
+
+   private:
+    std::string* str_ = nullptr;
+  };
+
+  explicit Impl(const Program& program)
+      : vm(std::shared_ptr<const VM::Program>(program.impl_,
+                                              &program.impl_->program)) {}
+
+  VM vm;
+  StringBuf buf;
+  std::ostream out{&buf};
+};
+
+Machine::Machine(const Program& program)
+    : impl_(std::make_unique<Impl>(program)) {}
+
+Machine::~Machine() = default;
+Machine::Machine(Machine&& other) noexcept = default;
+Machine& Machine::operator=(Machine&& other) noexcept = default;
+
+bool Machine::Run(std::int64_t max_steps) {
+  return impl_->vm.Run(max_steps);
+}
+
+void Machine::Reset() {
+  impl_->vm.Reset();
+}
+
+void Machine::SetOutput(std::string* out) {
+  impl_->buf.Set(out);
+  if (out) {
+    impl_->vm.SetOutput(impl_->out);
+  } else {
+    impl_->vm.SetOutput(std::cout);
+  }
+}
+
+void Machine::SetOutput(std::ostream& out) {
+  impl_->vm.SetOutput(out);
+}
+
+const std::vector<double>& Machine::GetStack() const {
+  return impl_->vm.GetStack();
+}
+
+void Machine::SetStack(const std::vector<double>& stack) {
+  impl_->vm.SetStack(stack);
+}
+
+double Machine::GetV(char var) const {
+  return impl_->vm.GetV(VM::ByteType(var));
+}
+
+void Machine::SetV(char var, double val) {
+  impl_->vm.SetV(VM::ByteType(var), val);
+}
+
+std::int64_t Machine::GetSteps() const {
+  return impl_->vm.GetSteps();
+}
+
+}  // namespace simplevm
+#endif  // VM_LIBRARY
+
+#if VM_COMPILER
+// Reads a program like the VM does, and writes out a C++ program that runs
+// it.
+int main() {
+  VM(ReadProgram(std::cin)).EmitCxx(std::cout);
+}
+#elif VM_BATCH
+// Runs a batch of jobs across all cores.  Each program file on the command
+// line is a job.  With `-i FILE`, each program instead runs once per line of
+// FILE, with that line's numbers pushed onto the stack first, as with
+// `vm --batch`.  Each job's output, followed by its step count, comes out in
+// job order.  Statistics go to stderr at the end.
+//
+// Usage: vm-batch [-j THREADS] [-i INPUTS] PROGRAM...
+int main(int argc, char *argv[]) {
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::vector<VM::ValueType>> inputs(1);  // One run, no inputs.
+  std::vector<std::string> progs;
+  for (int arg = 1; arg < argc; ++arg) {
+    const std::string_view flag = argv[arg];
+    if ((flag == "-j" || flag == "-i") && arg + 1 < argc) {
+      if (flag == "-j") {
+        threads = std::max(1, std::atoi(argv[++arg]));
+        continue;
+      }
+      std::ifstream file(argv[++arg]);
+      if (!file) {
+        std::cerr << "Can't read inputs from '" << argv[arg] << "'.\n";
+        return 1;
+      }
+      inputs = ReadInputs(file);
+      continue;
+    }
+    std::ifstream file(argv[arg]);
+    if (!file) {
+      std::cerr << "Can't read program '" << argv[arg] << "'.\n";
+      return 1;
+    }
+    progs.push_back(ReadProgram(file));
+  }
+  if (progs.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-j THREADS] [-i INPUTS] PROGRAM...\n";
+    return 1;
+  }
+
+  // Each program is prescanned once, by the first worker to need it, and
+  // all the workers share it.  A worker resets its VM between runs of the
+  // same program.
+  std::vector<std::shared_ptr<const VM::Program>> prescanned(progs.size());
+  std::vector<std::once_flag> prescan_once(progs.size());
+  struct Worker {
+    std::size_t prog = SIZE_MAX;
+    std::unique_ptr<VM> vm;
+    std::ostringstream out;
+  };
+  std::vector<Worker> workers(threads);
+
+  using Clock = std::chrono::steady_clock;
+  const std::size_t jobs = progs.size() * inputs.size();
+  std::vector<std::string> output(jobs);
+  std::vector<double> latency(jobs);  // In microseconds.
+  std::vector<bool> done(jobs);
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+
+  const auto start = Clock::now();
+  std::thread runner([&] {
+    WorkStealingPool(jobs, threads).Run([&](int w, std::size_t job) {
+      const std::size_t prog = job / inputs.size();
+      Worker& worker = workers[w];
+      const auto job_start = Clock::now();
+      if (worker.prog != prog) {
+        std::call_once(prescan_once[prog], [&] {
+          prescanned[prog] = std::make_shared<const VM::Program>(progs[prog]);
+        });
+        worker.prog = prog;
+        worker.vm = std::make_unique<VM>(prescanned[prog]);
+        worker.vm->SetOutput(worker.out);
+      } else {
+        worker.vm->Reset();
+      }
+      worker.out.str({});
+      worker.vm->SetStack(inputs[job % inputs.size()]);
+      worker.vm->Run();
+      worker.out << "DONE.  " << worker.vm->GetSteps() << " steps\n";
+      latency[job] = std::chrono::duration<double, std::micro>(
+                         Clock::now() - job_start).count();
+
+      std::lock_guard<std::mutex> lock(done_mutex);
+      output[job] = worker.out.str();
+      done[job] = true;
+      done_cv.notify_all();
+    });
+  });
+
+  // Print each job's output as soon as it and every job before it are done.
+  for (std::size_t job = 0; job != jobs; ++job) {
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [&] { return done[job]; });
+    std::cout << output[job];
+    output[job] = {};
+  }
+  runner.join();
+  const double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  if (jobs == 0) {
+    return 0;
+  }
+  std::sort(latency.begin(), latency.end());
+  auto Percentile = [&](double p) {
+    return latency[std::min(jobs - 1, std::size_t(p / 100 * jobs))];
+  };
+  std::cerr << jobs << " jobs on " << threads << " threads in " << elapsed
+            << " s: " << jobs / elapsed << " jobs/s\n"
+            << "Latency (us): p50 " << Percentile(50) << ", p90 "
+            << Percentile(90) << ", p99 " << Percentile(99) << ", max "
+            << latency.back() << '\n';
+}
+#elif !VM_LIBRARY
+int main(int argc, char *argv[]) {
+  // `--compile IMAGE` prescans the program on stdin, and writes it to IMAGE
+  // as a precompiled image, rather than running it.
+  if (argc > 1 && std::string_view(argv[1]) == "--compile") {
+    std::ofstream image(argc > 2 ? argv[2] : "", std::ios::binary);
+    if (!image) {
+      std::cout << "Can't write image '" << (argc > 2 ? argv[2] : "")
+                << "'.\n";
+      return 1;
+    }
+    VM::Program(ReadProgram(std::cin)).WriteImage(image);
+    return image ? 0 : 1;
+  }
+
+  // Options come first, in any order.
+  //
+  // `--file PROG` runs the program in PROG, which it maps rather than
+  // reading, in place of a program on stdin.  `--image IMAGE` runs a
+  // precompiled image the same way.
+  //
+  // `--async` formats and writes the program's output on a thread of its
+  // own, so printing costs the run little more than queueing each value.
+  // The output is the same.
+  //
+  // `--binary` makes `'` and `!` write raw doubles, and `--binary-pc` makes
+  // them write each after the PC that printed it; see VM::OutputFormat.
+  // `--output FILE` writes the program's output to FILE.
+  //
+  // `--batch FILE` runs the program once per line of FILE, several lines
+  // at a time in lanes, with the line's numbers pushed onto the stack
+  // first.  It ignores the options that select how to run the program.
+  //
+  // `--samples FILE` samples where the run is, a thousand times a second of
+  // CPU time, and writes the samples to FILE as folded stacks for a flame
+  // graph; see VM::WriteSamples().  Only the interpreter takes samples.
+  //
+  // `--jit`, `--trace-jit` and `--copy-patch` run the program with the
+  // baseline JIT, the tracing JIT and the copy-and-patch JIT.
+  // `--reference` single-steps the reference interpreter, as tracing does,
+  // but quietly, for comparing its output with the other tiers'.
+  // `--caches` shows the inline caches' hit rates after the run.
+  //
+  // Any other argument traces the run in the reference interpreter, and
+  // `b` also shows the prescanner's branch-to-branch optimizations.
+  std::shared_ptr<const VM::Program> program;
+  bool async = false;
+  bool jit = false;
+  bool traced = false;
+  bool copy_patch = false;
+  bool reference = false;
+  bool show_caches = false;
+  auto format = VM::OutputFormat::kText;
+  std::ofstream output;
+  std::ofstream samples;
+  const char* batch = nullptr;
+  for (; argc > 1 && std::strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+    const std::string_view option = argv[1];
+    if (option == "--async") {
+      async = true;
+    } else if (option == "--jit") {
+      jit = true;
+    } else if (option == "--trace-jit") {
+      traced = true;
+    } else if (option == "--copy-patch") {
+      copy_patch = true;
+    } else if (option == "--reference") {
+      reference = true;
+    } else if (option == "--caches") {
+      show_caches = true;
+    } else if (option == "--binary") {
+      format = VM::OutputFormat::kBinary;
+    } else if (option == "--binary-pc") {
+      format = VM::OutputFormat::kBinaryWithPc;
+    } else if (option == "--file" || option == "--image") {
+      const char* const path = argc > 2 ? argv[2] : "";
+      program = option == "--file" ? VM::Program::MapText(path)
+                                   : VM::Program::MapImage(path);
+      if (!program) {
+        std::cout << "Can't load "
+                  << (option == "--file" ? "program" : "image") << " '"
+                  << path << "'.\n";
+        return 1;
+      }
+      --argc;
+      ++argv;
+    } else if (option == "--batch") {
+      batch = argc > 2 ? argv[2] : "";
+      --argc;
+      ++argv;
+    } else if (option == "--output" || option == "--samples") {
+      const char* const path = argc > 2 ? argv[2] : "";
+      auto& file = option == "--output" ? output : samples;
+      file.open(path, std::ios::binary);
+      if (!file) {
+        std::cout << "Can't write " << option.substr(2) << " '" << path
+                  << "'.\n";
+        return 1;
+      }
+      --argc;
+      ++argv;
+    } else {
+      std::cout << "Unknown option '" << option << "'.\n";
+      return 1;
+    }
+  }
+  if (!program) {
+    // Read the program on stdin.
+    program = std::make_shared<const VM::Program>(ReadProgram(std::cin));
+  }
+
+  g_debug_branch_opt = argc > 1 && argv[1][0] == 'b';
+  const bool trace = argc > 1;
+
+  // Binary output on stdout would be garbled by the text `vm` prints there
+  // itself, so that goes to stderr instead.
+  std::ostream binary_stdout(std::cout.rdbuf());
+  auto vm = VM(program);
+  if (output.is_open()) {
+    vm.SetOutput(output);
+  } else if (format != VM::OutputFormat::kText) {
+    vm.SetOutput(binary_stdout);
+    std::cout.rdbuf(std::cerr.rdbuf());
+  }
+  vm.SetOutputFormat(format);
+  if (async) {
+    vm.SetAsyncOutput();
+  }
+  if (samples.is_open()) {
+    vm.SetSampling(1000);
+  }
+
+  if (batch) {
+    if (format != VM::OutputFormat::kText) {
+      std::cout << "Batch mode only prints text.\n";
+      return 1;
+    }
+    std::ifstream file(batch);
+    if (!file) {
+      std::cout << "Can't read inputs from '" << batch << "'.\n";
+      return 1;
+    }
+    vm.RunBatch(ReadInputs(file));
+    return 0;
+  }
+
+  if (!trace && (jit || traced || copy_patch)) {
+    if (!(jit ? vm.RunJit() : traced ? vm.RunTraced() : vm.RunCopyPatch())) {
+      std::cout << "JIT not supported on this platform.\n";
+      vm.Run();
+    }
+  } else if (!trace && !reference) {
+    vm.Run();
+  } else {
+    bool terminate;
+    do {
+      if (trace) {
+        VM::LocType pc = vm.GetPc();
+        std::cout << "PC=" << pc << " '" << vm.ByteAt(pc) << "' ";
+        ShowTopN(vm.GetStack(), 10);
+        std::cout << '\n';
+      }
+      terminate = vm.Step();
+    } while (!terminate);
+  }
+
+  std::cout << "DONE.  " << vm.GetSteps() << " steps\n";
+  if (show_caches) {
+    ShowCallCaches(vm);
+  }
+#if VM_PROFILE
+  vm.ShowProfile(std::cerr);
+#endif
+  if (samples.is_open()) {
+    vm.WriteSamples(samples);
+  }
 }
+#endif  // VM_COMPILER
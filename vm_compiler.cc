@@ -0,0 +1,484 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// Compiles a program to a standalone C++ program, for `vmc`.
+
+#include "vm_internal.h"
+
+namespace simplevm::internal {
+
+#if VM_COMPILER
+// The runtime for programs compiled to C++.  This mirrors the fast run
+// loops' stack handling: Push(), Pop(), GrowStack(), DropN() and Rotate().
+// It follows the table of global labels, kLabels.
+constexpr char kCxxRuntime[] = R"(
+using LocType = std::int64_t;
+
+std::vector<double> g_stack(1024);
+double* g_base = g_stack.data();
+double* g_limit = g_base + g_stack.size();
+double g_var[256];
+
+double D(std::uint64_t bits) {
+  double d;
+  std::memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+void Grow(double*& sp, std::size_t min_size = 0) {
+  const auto depth = sp - g_base;
+  g_stack.resize(std::max(g_stack.size() * 2, min_size));
+  g_base = g_stack.data();
+  g_limit = g_base + g_stack.size();
+  sp = g_base + depth;
+}
+
+inline void Push(double*& sp, double& tos, double val) {
+  if (sp == g_limit) {
+    Grow(sp);
+  }
+  *sp++ = tos;
+  tos = val;
+}
+
+inline double Pop(double*& sp, double& tos) {
+  const double val = tos;
+  tos = sp != g_base ? *--sp : 0.;
+  return val;
+}
+
+std::int64_t Int(double d) {
+  if (std::isnan(d)) {
+    d = 0;
+  }
+  if (d >= 0x1p63) {
+    return INT64_MAX;
+  }
+  return std::int64_t(std::max(d, double(INT64_MIN)));
+}
+
+std::uint64_t Uint(double d) {
+  if (std::isnan(d)) {
+    d = 0;
+  }
+  if (d >= 0x1p64) {
+    return UINT64_MAX;
+  }
+  return std::uint64_t(std::max(d, 0.));
+}
+
+std::int64_t Nat(double d) {
+  if (std::isnan(d)) {
+    d = 0;
+  }
+  if (d >= 0x1p63) {
+    return INT64_MAX;
+  }
+  return std::int64_t(std::max(d, 0.));
+}
+
+LocType Resolve(double dst) {
+  if (dst < 0.) {
+    return ~Int(dst);
+  }
+  if (std::isnormal(dst)) {
+    const auto* const end = kLabels + kNumLabels;
+    const auto* const it = std::lower_bound(
+        kLabels, end, dst,
+        [](const Label& label, double val) { return label.value < val; });
+    if (it != end && it->value == dst) {
+      return it->pc;
+    }
+  }
+  return INT64_MAX;
+}
+
+void DropN(double*& sp, double& tos, std::int64_t n) {
+  if (n <= 0) {
+    return;
+  }
+  if (n > sp - g_base) {
+    sp = g_base;
+    tos = 0.;
+    return;
+  }
+  sp -= n;
+  tos = *sp;
+}
+
+void Rotate(double*& sp, double& tos, std::int64_t n) {
+  if (n < 0) {
+    const double old_tos = Pop(sp, tos);
+    const auto pn = std::uint64_t(0) - std::uint64_t(n);
+    auto depth = std::uint64_t(sp - g_base) + 1;
+    if (std::max(depth, pn) + 1 > g_stack.size()) {
+      Grow(sp, std::max(depth, pn) + 1);
+    }
+    *sp = tos;
+    if (pn > depth) {
+      std::copy_backward(g_base, g_base + depth, g_base + pn);
+      std::fill(g_base, g_base + pn - depth, 0.);
+      depth = pn;
+    }
+    double* const ins = g_base + depth - pn;
+    std::copy_backward(ins, g_base + depth, g_base + depth + 1);
+    *ins = old_tos;
+    sp = g_base + depth;
+    tos = *sp;
+  } else if (n > sp - g_base) {
+    Push(sp, tos, 0.);
+  } else if (n > 0) {
+    if (sp == g_limit) {
+      Grow(sp);
+    }
+    *sp = tos;
+    double* const src = sp - n;
+    const double val = *src;
+    std::copy(src + 1, sp + 1, src);
+    tos = val;
+  }
+}
+
+void PrintLn(double val) {
+  std::cout << val << '\n';
+}
+)";
+
+// Writes a double as an exact C++ expression.
+static std::string CxxDouble(double val) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &val, sizeof(bits));
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "D(0x%016llx)",
+                static_cast<unsigned long long>(bits));
+  return buf;
+}
+
+// Returns the static successors of instruction `i`, and sets `dynamic` if
+// it has a destination from the stack.  This mirrors Execute().
+std::vector<std::size_t> VM::Successors(std::size_t i, bool& dynamic) const {
+  const Insn& insn = code_[i];
+  const auto at = [&](LocType loc) { return std::size_t(At(loc) - &code_[0]); };
+  dynamic = false;
+  switch (insn.op) {
+    case kOpHalt: case kOpStop: return {};
+    case kOpUndefined: return {code_.size() - 1};
+    case kOpLiteral: return {at(insn.next)};
+    case kOpPushVar: return {std::size_t(insn.next)};
+    case kOpLitAdd: case kOpLitSub: case kOpLitMul: case kOpLitDiv:
+    case kOpLitDropN: case kOpLitRotate: return {std::size_t(insn.next) + 1};
+    case kOpIf: return {i + 1, at(insn.target)};
+    case kOpJump: case kOpLitCall: case kOpLitGoto: return {at(insn.target)};
+    case kOpDupIf: case kOpSwapIf: return {i + 2, at(code_[i + 1].target)};
+    case kOpSquare: return {i + 3};
+    case kOpStore: case kOpPrintVar: case kOpPrintDrop: return {i + 2};
+    case kOpCall: case kOpGoto: { dynamic = true; return {}; }
+    default: {
+      if (insn.op >= kOpEscPow && insn.op <= kOpEscCopySign) {
+        return {i + 2};
+      }
+      return {i + 1};
+    }
+  }
+}
+
+// Writes the program out as a C++ program that runs it, and prints the step
+// count like main() does.  Every reachable instruction becomes a block of
+// straight-line code, and branches become `goto`s.  If the program can reach
+// a `C` or `G`, all instructions are reachable, and a `switch` dispatches
+// their destinations to labels.
+void VM::EmitCxx(std::ostream& out) const {
+  static const char* const kNames[kNumOps] = {
+    "Halt", "Stop",
+#define VM_OPCODE_NAME(name) #name,
+    VM_OPCODES(VM_OPCODE_NAME)
+#undef VM_OPCODE_NAME
+  };
+  static const std::map<Op, const char*> kFxns = {
+    {kOpMod, "std::fmod"}, {kOpEscPow, "std::pow"},
+    {kOpEscHypot, "std::hypot"}, {kOpEscAtan2, "std::atan2"},
+    {kOpEscSin, "std::sin"}, {kOpEscAsin, "std::asin"},
+    {kOpEscCos, "std::cos"}, {kOpEscAcos, "std::acos"},
+    {kOpEscTan, "std::tan"}, {kOpEscAtan, "std::atan"},
+    {kOpEscSinh, "std::sinh"}, {kOpEscAsinh, "std::asinh"},
+    {kOpEscCosh, "std::cosh"}, {kOpEscAcosh, "std::acosh"},
+    {kOpEscTanh, "std::tanh"}, {kOpEscAtanh, "std::atanh"},
+    {kOpEscErf, "std::erf"}, {kOpEscErfc, "std::erfc"},
+    {kOpEscTgamma, "std::tgamma"}, {kOpEscLgamma, "std::lgamma"},
+    {kOpEscExp, "std::exp"}, {kOpEscLog, "std::log"},
+    {kOpEscLog2, "std::log2"}, {kOpEscSqrt, "std::sqrt"},
+    {kOpEscCbrt, "std::cbrt"}, {kOpEscCeil, "std::ceil"},
+    {kOpEscFloor, "std::floor"}, {kOpEscTrunc, "std::trunc"},
+    {kOpEscAbs, "std::abs"}, {kOpEscRound, "std::round"},
+    {kOpEscNearbyInt, "std::nearbyint"}, {kOpEscSignBit, "std::signbit"},
+    {kOpEscCopySign, "std::copysign"}, {kOpEscLdexp, "std::ldexp"},
+  };
+
+  const std::size_t count = code_.size();
+  const std::size_t entry = At(0) - &code_[0];
+
+  // Find the reachable instructions, and which of them need labels.
+  std::vector<bool> reachable(count), labeled(count);
+  bool dynamic = false;
+  std::vector<std::size_t> work{entry};
+  reachable[entry] = true;
+  while (!work.empty()) {
+    const std::size_t i = work.back();
+    work.pop_back();
+    bool insn_dynamic;
+    for (std::size_t succ : Successors(i, insn_dynamic)) {
+      if (!reachable[succ]) {
+        reachable[succ] = true;
+        work.push_back(succ);
+      }
+    }
+    dynamic = dynamic || insn_dynamic;
+  }
+  if (dynamic) {
+    std::fill(reachable.begin(), reachable.end(), true);
+    std::fill(labeled.begin(), labeled.end(), true);
+  }
+  std::vector<std::size_t> order;
+  for (std::size_t i = 0; i != count; ++i) {
+    if (reachable[i]) {
+      order.push_back(i);
+    }
+  }
+  labeled[entry] = labeled[entry] || entry != order.front();
+  for (std::size_t k = 0; k != order.size(); ++k) {
+    bool unused;
+    const auto succs = Successors(order[k], unused);
+    for (std::size_t n = 0; n != succs.size(); ++n) {
+      // The fallthrough is the first successor.
+      const bool falls = n == 0 && k + 1 != order.size() &&
+                         order[k + 1] == succs[0];
+      labeled[succs[n]] = labeled[succs[n]] || !falls;
+    }
+  }
+
+  out << "// Generated by vmc.  Do not edit.\n"
+      << "#include <algorithm>\n"
+      << "#include <cmath>\n"
+      << "#include <cstdint>\n"
+      << "#include <cstring>\n"
+      << "#include <iostream>\n"
+      << "#include <utility>\n"
+      << "#include <vector>\n\n"
+      << "namespace {\n\n"
+      << "struct Label {\n"
+      << "  double value;\n"
+      << "  std::int64_t pc;\n"
+      << "};\n\n"
+      << "double D(std::uint64_t bits);\n\n"
+      << "// Global labels, sorted by value.\n"
+      << "const Label kLabels[] = {\n";
+  LabelTable labels = global_label_;
+  labels.ForEach([&](ValueType label, LocType pc) {
+    out << "  {" << CxxDouble(label) << ", " << pc << "},\n";
+  });
+  out << "  {0., 0},\n"
+      << "};\n"
+      << "constexpr std::size_t kNumLabels = " << global_label_.size()
+      << ";\n"
+      << kCxxRuntime << "\n"
+      << "}  // namespace\n\n"
+      << "int main() {\n"
+      << "  double* sp = g_base;\n"
+      << "  double tos = 0.;\n"
+      << "  std::int64_t steps = 0;\n";
+  if (dynamic) {
+    out << "  LocType loc = 0;\n";
+  }
+  if (labeled[entry]) {
+    out << "  goto L" << entry << ";\n";
+  }
+  out << "\n";
+
+  const auto go = [&](std::size_t target) {
+    return "goto L" + std::to_string(target) + ";";
+  };
+
+  for (std::size_t k = 0; k != order.size(); ++k) {
+    const std::size_t i = order[k];
+    const Insn& insn = code_[i];
+    const std::string reg = std::to_string(insn.reg);
+    const std::string val = CxxDouble(insn.val);
+    const auto fxn = kFxns.find(insn.op);
+
+    if (labeled[i]) {
+      out << "L" << i << ":  // " << kNames[insn.op] << "\n";
+    } else {
+      out << "  // " << kNames[insn.op] << "\n";
+    }
+    out << "  {\n";
+    if (StepsFor(insn.op) != 0) {
+      out << "    steps += " << StepsFor(insn.op) << ";\n";
+    }
+    const char* const pop2 = "    const double rhs = Pop(sp, tos);\n";
+
+    switch (insn.op) {
+      case kOpHalt: case kOpStop: { out << "    goto done;\n"; break; }
+      case kOpUndefined: {
+        out << "    std::cout << \"Undefined bytecode '\" << " << insn.code
+            << " << \"' at \" << " << insn.next - 1
+            << " << \". Terminating.\\n\";\n"
+            << "    goto done;\n";
+        break;
+      }
+      case kOpLiteral: { out << "    Push(sp, tos, " << val << ");\n"; break; }
+      case kOpPushVar: {
+        out << "    Push(sp, tos, g_var[" << reg << "]);\n";
+        break;
+      }
+      case kOpStore: {
+        out << "    g_var[" << reg << "] = Pop(sp, tos);\n";
+        break;
+      }
+      case kOpAdd: { out << pop2 << "    tos = tos + rhs;\n"; break; }
+      case kOpSub: { out << pop2 << "    tos = tos - rhs;\n"; break; }
+      case kOpMul: { out << pop2 << "    tos = tos * rhs;\n"; break; }
+      case kOpDiv: { out << pop2 << "    tos = tos / rhs;\n"; break; }
+      case kOpNeg: { out << "    tos = -tos;\n"; break; }
+      case kOpAnd: case kOpOr: case kOpXor: {
+        const char bit_op = insn.op == kOpAnd ? '&' : insn.op == kOpOr ? '|'
+                          : '^';
+        out << pop2 << "    tos = Uint(tos) " << bit_op << " Uint(rhs);\n";
+        break;
+      }
+      case kOpShl: case kOpShr: {
+        out << "    tos = std::exp2(tos);\n" << pop2 << "    tos = tos "
+            << (insn.op == kOpShl ? '*' : '/') << " rhs;\n";
+        break;
+      }
+      case kOpPrintTop: { out << "    PrintLn(tos);\n"; break; }
+      case kOpPrintVar: {
+        out << "    PrintLn(g_var[" << reg << "]);\n";
+        break;
+      }
+      case kOpCall: {
+        out << "    loc = Resolve(Pop(sp, tos));\n"
+            << "    Push(sp, tos, " << ~insn.next << ");\n"
+            << "    goto dispatch;\n";
+        break;
+      }
+      case kOpGoto: {
+        out << "    loc = Resolve(Pop(sp, tos));\n"
+            << "    goto dispatch;\n";
+        break;
+      }
+      case kOpInt: { out << "    tos = Int(tos);\n"; break; }
+      case kOpUint: { out << "    tos = Uint(tos);\n"; break; }
+      case kOpDup: { out << "    Push(sp, tos, tos);\n"; break; }
+      case kOpDrop: { out << "    Pop(sp, tos);\n"; break; }
+      case kOpDropN: {
+        out << "    DropN(sp, tos, Nat(Pop(sp, tos)));\n";
+        break;
+      }
+      case kOpRotate: {
+        out << "    Rotate(sp, tos, Int(Pop(sp, tos)));\n";
+        break;
+      }
+      case kOpSwap: {
+        out << "    if (sp != g_base) {\n"
+            << "      std::swap(tos, sp[-1]);\n"
+            << "    } else {\n"
+            << "      Push(sp, tos, 0.);\n"
+            << "    }\n";
+        break;
+      }
+      case kOpIf: {
+        out << "    if (Pop(sp, tos) < 0) " << go(At(insn.target) - &code_[0])
+            << "\n";
+        break;
+      }
+      case kOpJump: case kOpLitGoto: break;
+      case kOpEscHypot3: {
+        out << "    const double x = Pop(sp, tos), y = Pop(sp, tos);\n"
+            << "    tos = std::hypot(tos, y, x);\n";
+        break;
+      }
+      case kOpEscFrexp: {
+        out << "    int exp;\n"
+            << "    tos = std::frexp(tos, &exp);\n"
+            << "    Push(sp, tos, exp);\n";
+        break;
+      }
+      case kOpEscModf: {
+        out << "    double int_part;\n"
+            << "    tos = std::modf(tos, &int_part);\n"
+            << "    Push(sp, tos, int_part);\n";
+        break;
+      }
+      case kOpEscHypot: case kOpEscAtan2: case kOpEscCopySign: case kOpMod:
+      case kOpEscPow: case kOpEscLdexp: {
+        out << pop2 << "    tos = " << fxn->second << "(tos, "
+            << (insn.op == kOpEscLdexp ? "int(rhs)" : "rhs") << ");\n";
+        break;
+      }
+      case kOpLitAdd: { out << "    tos += " << val << ";\n"; break; }
+      case kOpLitSub: { out << "    tos -= " << val << ";\n"; break; }
+      case kOpLitMul: { out << "    tos *= " << val << ";\n"; break; }
+      case kOpLitDiv: { out << "    tos /= " << val << ";\n"; break; }
+      case kOpLitDropN: {
+        out << "    DropN(sp, tos, Nat(" << val << "));\n";
+        break;
+      }
+      case kOpLitRotate: {
+        out << "    Rotate(sp, tos, Int(" << val << "));\n";
+        break;
+      }
+      case kOpLitCall: {
+        out << "    Push(sp, tos, " << ~(insn.next + 1) << ");\n";
+        break;
+      }
+      case kOpDupIf: {
+        out << "    if (tos < 0) " << go(At(code_[i + 1].target) - &code_[0])
+            << "\n";
+        break;
+      }
+      case kOpSwapIf: {
+        out << "    const double nos = sp != g_base ? *--sp : 0.;\n"
+            << "    if (nos < 0) " << go(At(code_[i + 1].target) - &code_[0])
+            << "\n";
+        break;
+      }
+      case kOpSquare: { out << "    Push(sp, tos, tos * tos);\n"; break; }
+      case kOpPrintDrop: {
+        out << "    PrintLn(tos);\n"
+            << "    Pop(sp, tos);\n";
+        break;
+      }
+      default: {
+        // The remaining library escapes take one operand.
+        out << "    tos = " << fxn->second << "(tos);\n";
+        break;
+      }
+    }
+
+    // Continue to the fallthrough successor.
+    bool unused;
+    const auto succs = Successors(i, unused);
+    if (!succs.empty() &&
+        (k + 1 == order.size() || order[k + 1] != succs[0])) {
+      out << "    " << go(succs[0]) << "\n";
+    }
+    out << "  }\n";
+  }
+
+  if (dynamic) {
+    const std::size_t size = prog_.size();
+    out << "\ndispatch:\n"
+        << "  switch (std::uint64_t(loc) < " << size << "u ? loc : " << size
+        << ") {\n";
+    for (std::size_t i = 0; i <= size; ++i) {
+      out << "    case " << i << ": " << go(i) << "\n";
+    }
+    out << "  }\n";
+  }
+  out << "\ndone:\n"
+      << "  std::cout << \"DONE.  \" << steps << \" steps\\n\";\n"
+      << "}\n";
+}
+#endif  // VM_COMPILER
+
+}  // namespace simplevm::internal
@@ -0,0 +1,311 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// The copy-and-patch JIT, which builds the program's native code out of the
+// stencils that vm_stencil_gen extracted into vm_stencils.h.
+
+#include "vm_internal.h"
+
+#if VM_JIT && VM_COPY_PATCH
+#include <dlfcn.h>
+
+#include "vm_stencils.h"
+#endif
+
+namespace simplevm::internal {
+
+#if VM_JIT && VM_COPY_PATCH
+// A copy-and-patch JIT.  This builds native code for the program without an
+// assembler, by copying the machine code for each instruction's stencil
+// into place, one after another, and patching the stencil's holes with the
+// instruction's operands and the addresses of its successors.  The stencils
+// are compiled from Execute(), and extracted by vm_stencil_gen at build
+// time.  See VM::Stencil().
+//
+// Code and data the stencils share, such as GrowStack() and constants, is
+// copied once, ahead of the stencils.  Stencils call into libraries through
+// a small table of addresses and jumps, which this fills in with dlsym().
+class VM::CopyPatch {
+ public:
+  explicit CopyPatch(VM& vm);
+  ~CopyPatch();
+
+  CopyPatch(const CopyPatch&) = delete;
+  CopyPatch& operator=(const CopyPatch&) = delete;
+
+  // Returns true if it found all the symbols the stencils need, and could
+  // make its code executable.
+  bool Ok() const { return mem_ != nullptr; }
+
+  // Runs the program from the VM's current PC until it terminates.
+  void Run();
+
+ private:
+  using Stencil = vm_stencils::Stencil;
+  using Reloc = vm_stencils::Reloc;
+  using Fxn = void(VM* vm, ValueType* sp, int64_t steps, ValueType tos);
+
+  // Each library symbol gets an address slot, and a jump through it, for
+  // calls that want a nearby target.
+  struct External {
+    std::uint64_t addr;
+    unsigned char jump[8];
+  };
+
+  const Insn* Successor(const Insn* ip) const;
+  std::size_t CopySize(const Insn* ip) const;
+  std::uint64_t HoleValue(int hole, std::size_t index) const;
+  std::uint64_t* GotSlot(std::uint64_t addr);
+  void Patch(unsigned char* code, const Reloc* relocs, std::size_t size,
+             std::size_t num_relocs, std::size_t index);
+
+  VM& vm_;
+  unsigned char* mem_ = nullptr;
+  std::size_t mem_size_ = 0;
+  unsigned char* shared_ = nullptr;
+  External* externals_ = nullptr;
+  std::uint64_t* got_ = nullptr;       // Address slots for shared code.
+  std::size_t got_size_ = 0;
+  std::vector<const void*> native_;    // Native address of each Insn.
+};
+
+VM::CopyPatch::CopyPatch(VM& vm) : vm_(vm) {
+  using namespace vm_stencils;
+  const std::size_t count = vm_.code_.size();
+
+  std::vector<std::uint64_t> ext_addrs(kNumExternals);
+  for (std::size_t i = 0; i != kNumExternals; ++i) {
+    ext_addrs[i] = reinterpret_cast<std::uintptr_t>(
+        dlsym(RTLD_DEFAULT, kExternals[i]));
+    if (!ext_addrs[i]) {
+      return;
+    }
+  }
+
+  // Lay out the shared code, the library table, and address slots for any
+  // loads of shared addresses, followed by the stencils.
+  std::size_t num_got = 0;
+  for (std::size_t i = 0; i != kNumSharedRelocs; ++i) {
+    num_got += kSharedRelocs[i].type == kGotPc32;
+  }
+  for (const Stencil& stencil : kStencils) {
+    for (std::size_t i = 0; i != stencil.num_relocs; ++i) {
+      num_got += stencil.relocs[i].type == kGotPc32;
+    }
+  }
+  const std::size_t shared_size = (kSharedSize + 15) & ~std::size_t(15);
+  const std::size_t ext_size = kNumExternals * sizeof(External);
+  const std::size_t got_size = num_got * sizeof(std::uint64_t);
+  std::size_t code_size = 0;
+  for (std::size_t i = 0; i != count; ++i) {
+    code_size += CopySize(&vm_.code_[i]);
+  }
+
+  mem_size_ = shared_size + ext_size + got_size + code_size;
+  void* const mem = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  mem_ = static_cast<unsigned char*>(mem);
+  shared_ = mem_;
+  externals_ = reinterpret_cast<External*>(mem_ + shared_size);
+  got_ = reinterpret_cast<std::uint64_t*>(mem_ + shared_size + ext_size);
+
+  for (std::size_t i = 0; i != kNumExternals; ++i) {
+    // jmp [rip - 14], which is the address slot.
+    externals_[i] = {ext_addrs[i], {0xFF, 0x25, 0xF2, 0xFF, 0xFF, 0xFF,
+                                    0xCC, 0xCC}};
+  }
+
+  unsigned char* code = mem_ + shared_size + ext_size + got_size;
+  native_.resize(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    native_[i] = code;
+    code += CopySize(&vm_.code_[i]);
+  }
+
+  std::memcpy(shared_, kShared, kSharedSize);
+  Patch(shared_, kSharedRelocs, kSharedSize, kNumSharedRelocs, 0);
+  for (std::size_t i = 0; i != count; ++i) {
+    const Stencil& stencil = kStencils[vm_.code_[i].op];
+    auto* const dst = static_cast<unsigned char*>(
+        const_cast<void*>(native_[i]));
+    const std::size_t size = CopySize(&vm_.code_[i]);
+    std::memcpy(dst, stencil.code, size);
+    Patch(dst, stencil.relocs, size, stencil.num_relocs, i);
+  }
+
+  if (mprotect(mem_, mem_size_, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem_, mem_size_);
+    mem_ = nullptr;
+  }
+}
+
+VM::CopyPatch::~CopyPatch() {
+  if (mem_) {
+    munmap(mem_, mem_size_);
+  }
+}
+
+void VM::CopyPatch::Run() {
+  const Regs r = vm_.LoadRegs();
+  auto* const entry =
+      reinterpret_cast<Fxn*>(const_cast<void*>(native_[vm_.At(vm_.pc_) -
+                                                       vm_.code_.data()]));
+  entry(&vm_, r.sp, vm_.steps_, r.tos);
+}
+
+// Returns the successor of `ip` that isn't one of the instructions that
+// follow it, if there is one.  This mirrors Execute().
+const VM::Insn* VM::CopyPatch::Successor(const Insn* ip) const {
+  const Insn* const code = vm_.code_.data();
+  switch (ip->op) {
+    case kOpLiteral: return vm_.At(ip->next);
+    case kOpPushVar: return code + ip->next;
+    case kOpLitAdd: case kOpLitSub: case kOpLitMul: case kOpLitDiv:
+    case kOpLitDropN: case kOpLitRotate: return code + ip->next + 1;
+    case kOpIf: case kOpJump: case kOpLitCall: case kOpLitGoto: {
+      return vm_.At(ip->target);
+    }
+    case kOpDupIf: case kOpSwapIf: return vm_.At(ip[1].target);
+    case kOpUndefined: return &vm_.code_.back();
+    default: return ip;
+  }
+}
+
+// Returns the size of the copy of `ip`'s stencil.  A stencil that ends by
+// jumping to the instruction that follows it can fall through instead.
+std::size_t VM::CopyPatch::CopySize(const Insn* ip) const {
+  const Stencil& stencil = vm_stencils::kStencils[ip->op];
+  if (stencil.num_relocs == 0 || ip == &vm_.code_.back()) {
+    return stencil.size;
+  }
+  const Reloc& last = stencil.relocs[stencil.num_relocs - 1];
+  if (last.kind == vm_stencils::kTargetHole &&
+      last.index == vm_stencils::kHoleCont1 &&
+      last.offset + 4 == stencil.size &&
+      stencil.code[last.offset - 1] == 0xE9) {
+    return stencil.size - 5;
+  }
+  return stencil.size;
+}
+
+// Returns the value for a hole in the stencil for instruction `index`.
+std::uint64_t VM::CopyPatch::HoleValue(int hole, std::size_t index) const {
+  using namespace vm_stencils;
+  const Insn& insn = vm_.code_[index];
+  const std::size_t last = vm_.code_.size() - 1;
+  const auto addr = [](const void* p) {
+    return std::uint64_t(reinterpret_cast<std::uintptr_t>(p));
+  };
+  switch (hole) {
+    case kHoleVal: {
+      std::uint64_t bits;
+      std::memcpy(&bits, &insn.val, sizeof(bits));
+      return bits;
+    }
+    case kHoleReg: return insn.reg;
+    case kHoleCode: return std::uint64_t(insn.code);
+    case kHoleNext: return std::uint64_t(insn.next);
+    case kHoleTarget: return std::uint64_t(insn.target);
+    case kHoleTarget1: {
+      return index < last ? std::uint64_t(vm_.code_[index + 1].target) : 0;
+    }
+    case kHoleSuccInsn: return addr(Successor(&insn));
+    case kHoleTable: return addr(native_.data());
+    case kHoleCont1: return addr(native_[std::min(index + 1, last)]);
+    case kHoleCont2: return addr(native_[std::min(index + 2, last)]);
+    case kHoleCont3: return addr(native_[std::min(index + 3, last)]);
+    case kHoleSucc: {
+      return addr(native_[Successor(&insn) - vm_.code_.data()]);
+    }
+  }
+  return 0;
+}
+
+// Returns an address slot holding `addr`, adding it if necessary.
+std::uint64_t* VM::CopyPatch::GotSlot(std::uint64_t addr) {
+  for (std::size_t i = 0; i != got_size_; ++i) {
+    if (got_[i] == addr) {
+      return &got_[i];
+    }
+  }
+  got_[got_size_] = addr;
+  return &got_[got_size_++];
+}
+
+// Applies the relocations to a copy of a stencil, or the shared code.
+void VM::CopyPatch::Patch(unsigned char* code, const Reloc* relocs,
+                          std::size_t size, std::size_t num_relocs,
+                          std::size_t index) {
+  using namespace vm_stencils;
+  for (std::size_t i = 0; i != num_relocs; ++i) {
+    const Reloc& reloc = relocs[i];
+    if (reloc.offset >= size) {
+      continue;  // The jump removed by CopySize().
+    }
+    unsigned char* const where = code + reloc.offset;
+    const auto pc = std::uint64_t(reinterpret_cast<std::uintptr_t>(where));
+
+    std::uint64_t target = 0;
+    switch (reloc.kind) {
+      case kTargetHole: {
+        target = HoleValue(reloc.index, index);
+        break;
+      }
+      case kTargetShared: {
+        target = reinterpret_cast<std::uintptr_t>(shared_ + reloc.index);
+        break;
+      }
+      case kTargetExternal: {
+        const External& ext = externals_[reloc.index];
+        target = reloc.type == kPc32
+                     ? reinterpret_cast<std::uintptr_t>(ext.jump) : ext.addr;
+        break;
+      }
+    }
+
+    switch (reloc.type) {
+      case kAbs64: {
+        const std::uint64_t val = target + reloc.addend;
+        std::memcpy(where, &val, sizeof(val));
+        break;
+      }
+      case kPc32: case kGotPc32: {
+        if (reloc.type == kGotPc32) {
+          target = reinterpret_cast<std::uintptr_t>(
+              reloc.kind == kTargetExternal ? &externals_[reloc.index].addr
+                                            : GotSlot(target));
+        }
+        const auto val = std::int32_t(target + reloc.addend - pc);
+        std::memcpy(where, &val, sizeof(val));
+        break;
+      }
+    }
+  }
+}
+
+// Compiles the program on first use, and runs it.
+bool VM::RunCopyPatch() {
+  if (!copy_patch_) {
+    copy_patch_.reset(new CopyPatch(*this));
+  }
+  if (!copy_patch_->Ok()) {
+    return false;
+  }
+  copy_patch_->Run();
+  FlushOutput();
+  return true;
+}
+
+void VM::JitDeleter::operator()(CopyPatch* copy_patch) const {
+  delete copy_patch;
+}
+#else
+bool VM::RunCopyPatch() {
+  return false;
+}
+#endif  // VM_JIT && VM_COPY_PATCH
+
+}  // namespace simplevm::internal
@@ -0,0 +1,1788 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// The VM itself, shared by vm.cc, the JITs and the C++ emitter: the build
+// options, the pre-decoded program, and the machine that runs it.  Everything
+// Execute() calls is defined here, inline, so the copy-and-patch stencils,
+// which vm_stencils.cc compiles from Execute(), carry all of it with them.
+
+#ifndef VM_INTERNAL_H_
+#define VM_INTERNAL_H_
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// The JIT emits x86-64 code into mmap()ed memory.
+#ifndef VM_JIT
+#if defined(__x86_64__) && defined(__unix__)
+#define VM_JIT 1
+#else
+#define VM_JIT 0
+#endif
+#endif
+
+// Builds the copy-and-patch JIT's stencils, from vm_stencils.cc.  See
+// VM::Stencil() and vm_stencil_gen.cc.
+#ifndef VM_STENCILS
+#define VM_STENCILS 0
+#endif
+
+// Builds `vmc`, which compiles the program to C++ rather than running it.
+#ifndef VM_COMPILER
+#define VM_COMPILER 0
+#endif
+
+// Builds `vm-batch`, which runs many jobs across all cores.
+#ifndef VM_BATCH
+#define VM_BATCH 0
+#endif
+
+// Builds libsimplevm, the API in simplevm.h, rather than a program.
+#ifndef VM_LIBRARY
+#define VM_LIBRARY 0
+#endif
+
+// Includes the copy-and-patch JIT.  This needs the vm_stencils.h that
+// vm_stencil_gen extracts from a VM_STENCILS build.
+#ifndef VM_COPY_PATCH
+#define VM_COPY_PATCH 0
+#endif
+
+// Backs the fast run loops' stack with an mmap()ed reservation, with a page
+// of zeros below it, so that the rotations that reach below the bottom of
+// the stack only touch the pages they write.
+#ifndef VM_GUARDED_STACK
+#if defined(__unix__)
+#define VM_GUARDED_STACK 1
+#else
+#define VM_GUARDED_STACK 0
+#endif
+#endif
+
+// Maps program files and precompiled images into memory with mmap(), rather
+// than reading them, so they aren't copied, and processes running the same
+// image share its pages.
+#ifndef VM_MAPPED_FILES
+#if defined(__unix__)
+#define VM_MAPPED_FILES 1
+#else
+#define VM_MAPPED_FILES 0
+#endif
+#endif
+
+// Lets `vm --async` format and write the program's output on a thread of
+// its own.  The threads sleep and wake each other with POSIX semaphores.
+#ifndef VM_ASYNC_OUTPUT
+#if defined(__unix__)
+#define VM_ASYNC_OUTPUT 1
+#else
+#define VM_ASYNC_OUTPUT 0
+#endif
+#endif
+
+// Lets Run() sample where the program is, on SIGPROF, for `vm --samples`.
+#ifndef VM_SAMPLING
+#if defined(__unix__)
+#define VM_SAMPLING 1
+#else
+#define VM_SAMPLING 0
+#endif
+#endif
+
+// Builds `vm_profile`, whose Run() counts each instruction's runs and the
+// cycles they take, for a table on stderr at exit.  Other builds leave the
+// counters out altogether.
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
+
+#if VM_JIT || VM_GUARDED_STACK || VM_MAPPED_FILES
+#include <sys/mman.h>
+#endif
+
+#if VM_GUARDED_STACK || VM_MAPPED_FILES
+#include <unistd.h>
+#endif
+
+#if VM_MAPPED_FILES
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#if VM_ASYNC_OUTPUT
+#include <semaphore.h>
+#endif
+
+#if VM_BATCH || VM_ASYNC_OUTPUT || VM_SAMPLING
+#include <atomic>
+#endif
+
+#if VM_BATCH || VM_ASYNC_OUTPUT
+#include <thread>
+#endif
+
+#if VM_STENCILS
+// The stencils' continuations.  A stencil tail-calls one of these to go on
+// to the next instruction, and the JIT patches the call into a jump to that
+// instruction's stencil.
+extern "C" {
+using VmStencilFxn = void(void* vm, double* sp, std::int64_t steps,
+                          double tos);
+[[gnu::visibility("hidden")]] VmStencilFxn vm_hole_cont1;
+[[gnu::visibility("hidden")]] VmStencilFxn vm_hole_cont2;
+[[gnu::visibility("hidden")]] VmStencilFxn vm_hole_cont3;
+[[gnu::visibility("hidden")]] VmStencilFxn vm_hole_succ;
+}
+#endif
+
+namespace simplevm::internal {
+
+using std::int64_t;
+
+// Selects direct-threaded dispatch (GCC/Clang labels-as-values) for VM::Run(),
+// rather than a `switch`.
+#ifndef VM_THREADED_DISPATCH
+#define VM_THREADED_DISPATCH 0
+#endif
+
+// Selects tail-call dispatch for VM::Run(), where every opcode has its own
+// handler function, and each handler tail-calls the next through a table.
+// This wants [[clang::musttail]] to guarantee the tail calls.  Without it,
+// handlers return to a trampoline loop instead, which is correct but slower.
+#ifndef VM_TAILCALL_DISPATCH
+#define VM_TAILCALL_DISPATCH 0
+#endif
+
+#if VM_THREADED_DISPATCH + VM_TAILCALL_DISPATCH + VM_PROFILE > 1
+#error "Select at most one of VM_THREADED_DISPATCH, VM_TAILCALL_DISPATCH and \
+VM_PROFILE."
+#endif
+
+#if VM_TAILCALL_DISPATCH && defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define VM_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+
+// Opcodes for pre-decoded instructions, other than the kOpHalt and kOpStop
+// control opcodes.  Bytecodes with identical behavior share an opcode, e.g.
+// all the digits map to Literal.  Each library escape gets its own opcode.
+// The superinstructions at the end each stand for a common sequence of
+// bytecodes; see VM::Fuse().
+#define VM_OPCODES(X) \
+  X(Undefined) X(Literal) X(PushVar) X(Store) X(PrintTop) X(PrintVar) \
+  X(Add) X(Sub) X(Mul) X(Div) X(Neg) X(Mod) X(And) X(Or) X(Xor) X(Shl) \
+  X(Shr) X(Call) X(Goto) X(Int) X(Uint) X(Dup) X(Drop) X(DropN) X(Rotate) \
+  X(Swap) X(If) X(Jump) \
+  X(EscPow) X(EscHypot) X(EscHypot3) X(EscAtan2) X(EscSin) X(EscAsin) \
+  X(EscCos) X(EscAcos) X(EscTan) X(EscAtan) X(EscSinh) X(EscAsinh) \
+  X(EscCosh) X(EscAcosh) X(EscTanh) X(EscAtanh) X(EscErf) X(EscErfc) \
+  X(EscTgamma) X(EscLgamma) X(EscExp) X(EscLog) X(EscLog2) X(EscSqrt) \
+  X(EscCbrt) X(EscCeil) X(EscFloor) X(EscTrunc) X(EscAbs) X(EscRound) \
+  X(EscNearbyInt) X(EscFrexp) X(EscLdexp) X(EscModf) X(EscSignBit) \
+  X(EscCopySign) \
+  X(LitAdd) X(LitSub) X(LitMul) X(LitDiv) X(LitDropN) X(LitRotate) \
+  X(LitCall) X(LitGoto) X(DupIf) X(SwapIf) X(Square) X(PrintDrop)
+
+// A read-only view of an array, as C++20's std::span<const T>.
+template <typename T>
+class Span {
+ public:
+  Span() = default;
+  Span(const T* data, std::size_t size) : data_(data), size_(size) {}
+  Span(const std::vector<T>& vec) : Span(vec.data(), vec.size()) {}
+
+  const T* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  const T& operator[](std::size_t index) const { return data_[index]; }
+  const T& back() const { return data_[size_ - 1]; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+
+ private:
+  const T* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// A file's contents, mapped read-only, or read into memory if this build
+// can't map files.
+class MappedFile {
+ public:
+  // Maps or reads `path`.  Check ok() to see if that worked.
+  explicit MappedFile(const char* path) {
+#if VM_MAPPED_FILES
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      void* const addr =
+          st.st_size == 0 ? nullptr  // mmap() can't map an empty file.
+                          : mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                                 fd, 0);
+      if (addr != MAP_FAILED) {
+        bytes_ = {static_cast<const char*>(addr), std::size_t(st.st_size)};
+        ok_ = true;
+      }
+    }
+    close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    std::string bytes(std::istreambuf_iterator<char>(file), {});
+    copy_.resize((bytes.size() + 7) / 8);  // 8-byte aligned.
+    std::memcpy(copy_.data(), bytes.data(), bytes.size());
+    bytes_ = {reinterpret_cast<const char*>(copy_.data()), bytes.size()};
+    ok_ = bool(file);
+#endif
+  }
+
+  ~MappedFile() {
+#if VM_MAPPED_FILES
+    if (!bytes_.empty()) {
+      munmap(const_cast<char*>(bytes_.data()), bytes_.size());
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool ok() const { return ok_; }
+
+  // Gets the file's contents.  A mapping starts on a page boundary.
+  std::string_view bytes() const { return bytes_; }
+
+ private:
+  std::string_view bytes_{};
+  bool ok_ = false;
+#if !VM_MAPPED_FILES
+  std::vector<std::uint64_t> copy_{};
+#endif
+};
+
+class VM {
+ public:
+  using LocType = int64_t;
+  using ValueType = double;
+  using ByteType = unsigned char;
+
+  // Each build's main(), and the library, use only some of the entry points
+  // below, so the rest are [[maybe_unused]] rather than fenced off by build.
+
+  // A prescanned and translated program.  A Program never changes once
+  // it's built, so any number of VMs, on any number of threads, can share
+  // one.  Each VM holds only what a run changes: its stack, variables, PC,
+  // step count, inline caches and compiled code.
+  class Program;
+
+  // Prescans and translates `prog`, for this VM's own use.
+  [[maybe_unused]] explicit VM(std::string_view prog);
+
+  // Runs a program that other VMs may share.
+  explicit VM(std::shared_ptr<const Program> program);
+
+  VM(const VM&) = delete;
+  VM& operator=(const VM&) = delete;
+
+  // Writes out any output that's still buffered.
+  ~VM();
+
+  // Restarts the program from the beginning, with an empty stack and all
+  // variables 0.  This keeps the stack's memory and any compiled code.
+  void Reset() {
+    var_.fill(0);
+    stack_.clear();
+    pc_ = 0;
+    steps_ = 0;
+    terminate_ = false;
+  }
+
+  // Sends the program's output to `out`, rather than std::cout.
+  void SetOutput(std::ostream& out) {
+    FlushOutput();
+    out_ = &out;
+  }
+
+  // How `'` and `!` write the values they print.
+  enum class OutputFormat {
+    // A line of text per value, as `std::cout << val` prints it.
+    kText,
+    // The value's 8 bytes, as a little-endian IEEE-754 double.
+    kBinary,
+    // 16 bytes per value: the PC of the `'` or `!` that printed it, as a
+    // little-endian 64-bit integer, and then the value, as kBinary writes
+    // it.
+    kBinaryWithPc,
+  };
+
+  // Switches the format of the program's output.  The VM's messages, such
+  // as for an undefined bytecode, go to std::cerr while it's binary.
+  [[maybe_unused]] void SetOutputFormat(OutputFormat format);
+
+  // Formats and writes the program's output on a background thread from
+  // now on.  Printing then only queues the value.  The output still comes
+  // out in order, and all of it is out by the time a run returns.  Binary
+  // output has nothing to format, so it's always written directly.  Without
+  // VM_ASYNC_OUTPUT, this does nothing.
+  [[maybe_unused]] void SetAsyncOutput();
+
+  // Samples where Run() is, `hz` times a second of the process's CPU time,
+  // or stops sampling, given 0.  A process has one profiling timer, so only
+  // one VM should sample at a time.  Without VM_SAMPLING, this does nothing.
+  [[maybe_unused]] void SetSampling(int hz);
+
+  // Writes the samples as folded stacks, which flame graph tools read: a
+  // line per distinct stack, with its frames from the outermost in, and then
+  // the number of samples.  The innermost frame is where the run was, and
+  // the ones around it are the `C`s that led there.  Each frame names the
+  // global label its PC is under, or `main` before any, and the PC's line
+  // and column, as in `@12 3:7`.  Without VM_SAMPLING, there are none.
+  [[maybe_unused]] void WriteSamples(std::ostream& out) const;
+
+  // Runs the program until completion.
+  void Run() {
+#if VM_SAMPLING
+    if (sample_hz_ != 0) {
+      RunSampled();
+      FlushOutput();
+      return;
+    }
+#endif
+#if VM_THREADED_DISPATCH
+    RunThreaded();
+#elif VM_TAILCALL_DISPATCH
+    RunTailCall();
+#elif VM_PROFILE
+    RunProfiled();
+#else
+    RunSwitch();
+#endif
+    FlushOutput();
+  }
+
+  // Runs the program until completion, or until it has run at least
+  // `max_steps` more steps, whichever comes first.  A superinstruction can
+  // take the run a few steps past `max_steps`, as it always finishes.
+  // Returns true if the program has terminated.  Otherwise, the next call
+  // picks up where this one left off.
+  bool Run(int64_t max_steps) {
+    if (!terminate_) {
+      RunSwitch<true>(max_steps < kNoStepLimit - steps_
+                          ? steps_ + max_steps : kNoStepLimit);
+      FlushOutput();
+    }
+    return terminate_;
+  }
+
+  // Runs the program until completion with JIT-compiled native code, if this
+  // build supports it and the system lets it make the code executable.
+  // Returns false, without running anything, otherwise.
+  [[maybe_unused]] bool RunJit();
+
+  // Runs the program until completion with native code stitched together
+  // from precompiled stencils, if this build supports it.  Returns false,
+  // without running anything, otherwise.
+  [[maybe_unused]] bool RunCopyPatch();
+
+  // Runs the program until completion in the interpreter, compiling hot
+  // loops to native code as it finds them, if this build supports it.
+  // Returns false, without running anything, otherwise.
+  [[maybe_unused]] bool RunTraced();
+
+#if VM_COMPILER
+  // Writes the program out as a standalone C++ program.
+  void EmitCxx(std::ostream& out) const;
+#endif
+
+  // Runs the program once per input, several inputs at a time in lanes.
+  // Each input's values are pushed onto the stack, in order, before its run
+  // starts.  Prints each run's output, and then its step count, as
+  // main() does for a single run, in input order.
+  [[maybe_unused]] void RunBatch(
+      const std::vector<std::vector<ValueType>>& inputs);
+
+  // Single-steps the program.  This is the reference interpreter, which
+  // keeps the stack exactly as the program left it, for tracing.
+  [[maybe_unused]] bool Step();
+
+  // Gets a variable, given its bytecode.
+  ValueType GetV(ByteType var) const {
+    return var_[var];
+  }
+
+  // Sets a variable to a given value.
+  void SetV(ByteType var, ValueType val) {
+    var_[var] = val;
+  }
+
+  // Gets the current PC.
+  LocType GetPc() const {
+    return pc_;
+  }
+
+  // Sets the current PC.
+  void SetPc(LocType loc) {
+    pc_ = loc;
+  }
+
+  // Gets a read-only reference to the stack_.  Step() keeps it exact, but
+  // the fast run loops always have a TOS (see Regs), so a stack that one
+  // of them leaves empty reads back as {0}.
+  const std::vector<ValueType>& GetStack() const {
+    return stack_;
+  }
+
+  // Replaces the stack_, e.g. to give a run its inputs.  The last item is the
+  // top of stack.
+  void SetStack(const std::vector<ValueType>& stack) {
+    stack_ = stack;
+  }
+
+  // Gets the total number of steps executed.  This is the actual step count,
+  // and reflects any optimizations the prescanner performed, for example.
+  int64_t GetSteps() const {
+    return steps_;
+  }
+
+  // Gets the bytecode at a given PC.  Returns `X` (the termination bytecode)
+  // if PC is out of range.
+  ByteType ByteAt(LocType loc) const {
+    if (loc < 0 || loc >= LocType(prog_.size())) {
+      return kTerminateByte;
+    }
+    return ReadByte(prog_[loc]);
+  }
+
+  // An inline cache for a `C` or `G`, which remembers the global labels it
+  // resolved most recently, most recent first.  A site usually goes to the
+  // same label every time, or to one of a few, so this saves looking the
+  // label up in `global_label_`.  Return addresses don't need a lookup, so
+  // they don't go through the cache.
+  static constexpr int kCallCacheWays = 4;
+  static constexpr ValueType kNoLabel =  // An empty way.  NaN never hits.
+      std::numeric_limits<ValueType>::quiet_NaN();
+  struct CallCache {
+    LocType loc = 0;  // PC of the `C` or `G`.
+    std::array<ValueType, kCallCacheWays> label = {kNoLabel, kNoLabel,
+                                                   kNoLabel, kNoLabel};
+    std::array<LocType, kCallCacheWays> dst{};
+    int64_t hits = 0;
+    int64_t misses = 0;
+  };
+
+  // Gets the inline caches for the fast run loops' `C`s and `G`s, in program
+  // order.  Step() doesn't use these.
+  const std::vector<CallCache>& GetCallCaches() const {
+    return call_cache_;
+  }
+
+#if VM_PROFILE
+  // Shows where Run() spent its time: a row per bytecode, and per opcode it
+  // ran as, with its runs, steps and cycles, most cycles first.  A `\`
+  // escape gets a row of its own, and numeric literals share `0-9`.  Shows
+  // nothing if Run() hasn't run.
+  void ShowProfile(std::ostream& out) const;
+#endif
+
+ private:
+  using ValueLocPair = std::pair<ValueType, LocType>;
+
+  static constexpr LocType kTerminatePc = std::numeric_limits<LocType>::max();
+  static constexpr ByteType kTerminateByte = 'X';
+  static constexpr ByteType kByteMax = std::numeric_limits<ByteType>::max();
+
+  // Maps a library escape `\b` to its own opcode, above the range of plain
+  // bytecodes.
+  static constexpr int Esc(ByteType b) { return b + kByteMax + 1; }
+
+  enum Op : std::uint8_t {
+    kOpHalt,  // Terminates execution, counting a step.
+    kOpStop,  // Leaves the run loop, without counting a step.
+#define VM_OPCODE_ENUM(name) kOp##name,
+    VM_OPCODES(VM_OPCODE_ENUM)
+#undef VM_OPCODE_ENUM
+    kNumOps
+  };
+
+  // A pre-decoded instruction.  Translate() builds one of these for every
+  // location in `prog_`, so PCs double as instruction indices, and branching
+  // into the middle of a literal or an escape still does the right thing.
+  struct Insn {
+    Op op = kOpHalt;          // Opcode for the fast run loops.
+    Op base_op = kOpHalt;     // Opcode for Step(), without superinstructions.
+    ByteType reg = 0;         // Register for `a`..`z`, `M`, `V`, and `!`.
+    int code = 'X';           // FixWs(bytecode), or Esc(b) for `\b`.
+    LocType next = 0;         // PC of the next instruction in sequence.
+    LocType target = 0;       // Branch target for `?` and unconditionals,
+                              // the call_cache_ index for `C` and `G`, or
+                              // the PC itself for `'` and `!`.
+    ValueType val = 0;        // Value of a numeric literal.
+  };
+
+  // Registers for the fast run loops, which keep these in locals so the
+  // compiler can hold them in machine registers.  The top of stack is cached
+  // in `tos`, and the rest of the stack is in memory beneath `sp`.  There is
+  // always a TOS; it is 0 when nothing has been pushed, matching the infinite
+  // well of 0s beneath the stack.
+  struct Regs {
+    ValueType* sp;
+    ValueType tos;
+  };
+
+  // The fast run loops keep instruction pointers rather than PCs.  `code_`
+  // has these terminating instructions past the end of the program, so that
+  // a one- or two-byte instruction at the end falls through into kOpHalt.
+  static constexpr LocType kHaltSlots = 2;
+  static constexpr LocType kStopSlot = kHaltSlots;
+  static constexpr std::size_t kMinStack = 1024;
+  static constexpr int64_t kNoStepLimit = std::numeric_limits<int64_t>::max();
+
+#if VM_GUARDED_STACK
+  // The fast run loops' first stack reservation, in bytes.  GrowStack()
+  // doubles it as often as the stack needs, so each VM only takes address
+  // space in proportion to the deepest stack it has run, and vm-batch and
+  // libsimplevm can run thousands of VMs.  The kernel only backs the pages
+  // the stack actually reaches with memory.
+  static constexpr std::size_t kMinStackReserve = std::size_t(1) << 20;
+
+  // An mmap()ed stack: a read-only page of zeros, a floor that Rotate() can
+  // move the bottom of the stack down into, the stack, and a guard page.
+  // The floor and the stack each get half of the reservation.  Pushes check
+  // for room like the vector's, so the guard page only catches bugs.
+  class StackMapping {
+   public:
+    // Reserves at least `reserve` bytes.  Throws std::bad_alloc if the
+    // system won't map them.
+    inline explicit StackMapping(std::size_t reserve);
+    inline ~StackMapping();
+    StackMapping(const StackMapping&) = delete;
+    StackMapping& operator=(const StackMapping&) = delete;
+
+    std::size_t reserve() const { return size_ - 2 * page_; }
+    ValueType* floor() const { return floor_; }
+    ValueType* base() const { return base_; }
+    ValueType* limit() const { return limit_; }
+
+    // Zeroes [from, to), handing whole pages back to the kernel.
+    inline void Clear(ValueType* from, ValueType* to) const;
+
+   private:
+    void* addr_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t page_ = 0;
+    ValueType* floor_ = nullptr;
+    ValueType* base_ = nullptr;
+    ValueType* limit_ = nullptr;
+  };
+#endif
+
+  // Maps global labels to PCs.  Small positive integer labels, which the
+  // README recommends, index an array directly.  Everything else goes in an
+  // open-addressing hash table keyed on the label's bits, so computed
+  // destinations resolve in O(1) either way.
+  class LabelTable {
+   public:
+    // Sets a label's PC.  The last definition of a label wins.
+    void Set(ValueType label, LocType pc) {
+      if (IsDirect(label)) {
+        const auto index = std::size_t(label);
+        if (index >= direct_.size()) {
+          const auto max_size = std::size_t(kMaxDirect) + 1;
+          direct_.resize(std::max(index + 1,
+                                  std::min(direct_.size() * 2, max_size)),
+                         kNoPc);
+        }
+        size_ += direct_[index] == kNoPc;
+        direct_[index] = pc;
+        return;
+      }
+      if (2 * (hashed_size_ + 1) > hashed_.size()) {
+        Rehash();
+      }
+      Slot& slot = hashed_[Probe(Bits(label))];
+      if (slot.pc == kNoPc) {
+        slot.bits = Bits(label);
+        ++hashed_size_;
+        ++size_;
+      }
+      slot.pc = pc;
+    }
+
+    // Gets a label's PC, or kTerminatePc if the label isn't defined.
+    LocType Get(ValueType label) const {
+      if (label >= 1. && label < double(direct_.size())) {
+        const auto index = std::size_t(label);
+        if (double(index) == label) {
+          return direct_[index] == kNoPc ? kTerminatePc : direct_[index];
+        }
+      }
+      if (hashed_.empty()) {
+        return kTerminatePc;
+      }
+      const Slot& slot = hashed_[Probe(Bits(label))];
+      return slot.pc == kNoPc ? kTerminatePc : slot.pc;
+    }
+
+    // Gets the number of labels.
+    std::size_t size() const { return size_; }
+
+    // Calls `fxn(label, pc)` for each label in ascending order, with any NaNs
+    // last, where `pc` is a reference to the label's PC.
+    template <typename Fxn>
+    void ForEach(Fxn fxn) {
+      std::vector<std::pair<ValueType, LocType*>> labels;
+      labels.reserve(size_);
+      for (std::size_t index = 0; index != direct_.size(); ++index) {
+        if (direct_[index] != kNoPc) {
+          labels.emplace_back(ValueType(index), &direct_[index]);
+        }
+      }
+      for (Slot& slot : hashed_) {
+        if (slot.pc != kNoPc) {
+          ValueType label;
+          std::memcpy(&label, &slot.bits, sizeof(label));
+          labels.emplace_back(label, &slot.pc);
+        }
+      }
+      std::sort(labels.begin(), labels.end(),
+                [](const auto& a, const auto& b) {
+                  return a.first < b.first ||
+                         (!std::isnan(a.first) && std::isnan(b.first));
+                });
+      for (auto& [label, pc] : labels) {
+        fxn(label, *pc);
+      }
+    }
+
+   private:
+    // Labels up to this go in `direct_`, which is at most 512KiB.
+    static constexpr ValueType kMaxDirect = 65535.;
+    static constexpr LocType kNoPc = -1;  // An unused entry.
+
+    struct Slot {
+      std::uint64_t bits = 0;
+      LocType pc = kNoPc;
+    };
+
+    static bool IsDirect(ValueType label) {
+      return label >= 1. && label <= kMaxDirect &&
+             ValueType(std::size_t(label)) == label;
+    }
+
+    static std::uint64_t Bits(ValueType label) {
+      std::uint64_t bits;
+      std::memcpy(&bits, &label, sizeof(bits));
+      return bits;
+    }
+
+    // Finds the index of a label's slot, given its bits, or of the empty
+    // slot where it belongs.
+    std::size_t Probe(std::uint64_t bits) const {
+      const std::size_t mask = hashed_.size() - 1;
+      // Fibonacci hashing.  The product's top bits mix in all of the label's
+      // bits, as labels often differ only in their high mantissa bits.
+      std::size_t index = (bits * 0x9E3779B97F4A7C15ull) >> hash_shift_;
+      while (hashed_[index].pc != kNoPc && hashed_[index].bits != bits) {
+        index = (index + 1) & mask;
+      }
+      return index;
+    }
+
+    void Rehash() {
+      std::vector<Slot> old(std::max<std::size_t>(16, hashed_.size() * 2));
+      old.swap(hashed_);
+      hash_shift_ = 64;
+      for (std::size_t size = hashed_.size(); size > 1; size >>= 1) {
+        --hash_shift_;
+      }
+      for (const Slot& slot : old) {
+        if (slot.pc != kNoPc) {
+          hashed_[Probe(slot.bits)] = slot;
+        }
+      }
+    }
+
+    std::vector<LocType> direct_{};
+    std::vector<Slot> hashed_{};  // A power of 2 in size, at most half full.
+    std::size_t hashed_size_ = 0;
+    int hash_shift_ = 64;  // 64 - log2(hashed_.size())
+    std::size_t size_ = 0;
+  };
+
+  // The program, and views of the parts of it that running it uses.
+  std::shared_ptr<const Program> program_;
+  const std::string_view prog_;
+  const Span<Insn> code_;
+  const LabelTable& global_label_;
+
+  std::array<ValueType, kByteMax + 1> var_{};
+  std::vector<ValueType> stack_{};
+  // The fast run loops' stack, from stack_base_ up to stack_limit_.  Every
+  // slot below stack_base_ is 0, so popping the last item refills TOS with 0
+  // without a branch.  Rotate() can move stack_base_ anywhere from
+  // stack_floor_ up.
+#if VM_GUARDED_STACK
+  std::unique_ptr<StackMapping> stack_mapping_{};
+#else
+  std::vector<ValueType> stack_mem_{};  // The 0, then the stack.
+#endif
+  ValueType* stack_floor_ = nullptr;
+  ValueType* stack_base_ = nullptr;
+  ValueType* stack_limit_ = nullptr;
+  std::vector<CallCache> call_cache_{};
+  LocType pc_ = 0;
+  int64_t steps_ = 0;
+  bool terminate_ = false;
+  std::ostream* out_ = &std::cout;
+  OutputFormat out_format_ = OutputFormat::kText;
+  // Output that PrintLn() has formatted, from out_buf_ up to out_pos_.
+  // There's always room for one more PrintLn() below out_limit_.
+  std::unique_ptr<char[]> out_buf_{};
+  char* out_pos_ = nullptr;
+  char* out_limit_ = nullptr;
+#if VM_ASYNC_OUTPUT
+  class AsyncOutput;
+  std::unique_ptr<AsyncOutput> async_out_{};
+#endif
+
+  // Pushes an item onto the stack_.
+  void Push(double val) {
+    stack_.push_back(val);
+  }
+
+  // Returns the top of stack_.  Underflowing the stack is not an error.  It
+  // behaves as if there's an infinite well of 0s beneath it.
+  ValueType Pop() {
+    ValueType val = 0;
+    if (!stack_.empty()) {
+      val = stack_.back();
+      stack_.pop_back();
+    }
+    return val;
+  }
+
+  // Returns a reference to top of stack_.  You must not use this reference
+  // after a Push() or Pop().
+  ValueType& Top() {
+    if (stack_.empty()) {
+      stack_.push_back(0.);
+    }
+    return stack_.back();
+  }
+
+  // Pushes an item in the fast run loops.
+  void Push(Regs& r, ValueType val) {
+    if (r.sp == stack_limit_) {
+      GrowStack(r);
+    }
+    *r.sp++ = r.tos;
+    r.tos = val;
+  }
+
+  // Pops an item in the fast run loops.  The TOS refills with 0 when the
+  // stack runs dry, from the 0 below the stack.
+  ValueType Pop(Regs& r) const {
+    const ValueType val = r.tos;
+    r.tos = r.sp[-1];
+    r.sp = std::max(r.sp - 1, stack_base_);
+    return val;
+  }
+
+  // Gets the instruction for a PC in the fast run loops.  Out-of-range PCs
+  // map onto kOpHalt.
+  const Insn* At(LocType loc) const {
+    const auto size = prog_.size();
+    return &code_[uint64_t(loc) < size ? loc : size];
+  }
+
+  // Converts the double to an integer that fits within an int64_t.  Treats
+  // NaN as 0.
+  static int64_t Int(ValueType val) {
+    double d = double(val);
+    if (std::isnan(d)) {
+      d = 0;
+    }
+    // double(INT64_MAX) rounds up to 2^63, which doesn't fit, so the top end
+    // can't just be clamped.
+    if (d >= 0x1p63) {
+      return INT64_MAX;
+    }
+    return int64_t(std::max(d, double(INT64_MIN)));
+  }
+
+  // Converts the double to an integer that fits within an uint64_t.  Treats
+  // NaN as 0.
+  static uint64_t Uint(ValueType val) {
+    double d = double(val);
+    if (std::isnan(d)) {
+      d = 0;
+    }
+    if (d >= 0x1p64) {
+      return UINT64_MAX;
+    }
+    return uint64_t(std::max(d, 0.));
+  }
+
+  // Converts the double to a "Natural" number (non-negative integer) that
+  // fits within an int64_t.  Treats NaN as 0.
+  static int64_t Nat(ValueType val) {
+    double d = double(val);
+    if (std::isnan(d)) {
+      d = 0;
+    }
+    if (d >= 0x1p63) {
+      return INT64_MAX;
+    }
+    return int64_t(std::max(d, 0.));
+  }
+
+  // Resolves a destination into a PC address.  Positive values correspond to
+  // global labels, while negative values are the bitwise inverse of a PC
+  // address.
+  static LocType Resolve(const LabelTable& labels, ValueType val) {
+    double dst = double(val);
+    if (dst < 0.) {
+      return ~Int(dst);
+    }
+
+    if (std::isnormal(dst)) {
+      return labels.Get(dst);  // Not found?  Terminate.
+    }
+
+    return kTerminatePc;
+  }
+
+  LocType Resolve(ValueType val) const {
+    return Resolve(global_label_, val);
+  }
+
+  // Resolves a destination for a `C` or `G` in a fast run loop, through the
+  // site's inline cache.
+  LocType Resolve(ValueType val, CallCache& cache) {
+    if (val < 0.) {
+      return ~Int(val);
+    }
+
+    for (int way = 0; way != kCallCacheWays; ++way) {
+      if (cache.label[way] == val) {
+        // Move the hit to the front.
+        const LocType dst = cache.dst[way];
+        std::copy_backward(cache.label.begin(), cache.label.begin() + way,
+                           cache.label.begin() + way + 1);
+        std::copy_backward(cache.dst.begin(), cache.dst.begin() + way,
+                           cache.dst.begin() + way + 1);
+        cache.label[0] = val;
+        cache.dst[0] = dst;
+        ++cache.hits;
+        return dst;
+      }
+    }
+
+    // Miss.  Evict the least recently used label.
+    const LocType dst = Resolve(val);
+    std::copy_backward(cache.label.begin(), cache.label.end() - 1,
+                       cache.label.end());
+    std::copy_backward(cache.dst.begin(), cache.dst.end() - 1,
+                       cache.dst.end());
+    cache.label[0] = val;
+    cache.dst[0] = dst;
+    ++cache.misses;
+    return dst;
+  }
+
+  // Drops the top N elements of the stack_.
+  void DropN(int64_t n) {
+    if (n > 0 && n < int64_t(stack_.size())) {
+      stack_.resize(stack_.size() - n);
+    } else if (n >= int64_t(stack_.size())) {
+      stack_.clear();
+    }
+  }
+
+  // Rotates the top N elements of the stack by extracting the Nth element
+  // from the top, sliding everything else down, and pushing the extracted
+  // element at the top.  0 leaves the stack unmodified, while 1 swaps the
+  // top two elements.
+  void Rotate(int64_t n) {
+    // C++'s integer promotion rules cause problems for signed vs. unsigned
+    // comparisons.  So, pull out the negative cases for `n` first.
+
+    if (n < 0) {
+      const auto old_tos = Pop();  // This handles the empty stack case too.
+      const auto pn = uint64_t(0) - uint64_t(n);
+
+      // We must reify virtual stack elements if -n > size().  To avoid O(n^2)
+      // behavior for certain pathological programs, we'll grow the stack to
+      // whatever power of 2 is greater or equal to -n.
+      if (pn > stack_.size()) {
+        // Old-school trick to find a power of 2 greater than to another
+        // integer.
+        auto x = pn;
+        x = x | (x >> 1);
+        x = x | (x >> 2);
+        x = x | (x >> 4);
+        x = x | (x >> 6);
+        x = x | (x >> 16);
+        x = x | (x >> 32);
+        x += 1;
+        stack_.insert(stack_.begin(), x, 0.);
+
+        // Since the above guarantees the new stack is at least 1 larger
+        // than necessary, we can simply overwrite the reified 0.
+        const auto it = stack_.end() - pn - 1;
+        *it = old_tos;
+      } else {
+        // Just insert the item, and pay for the O(n) copy.
+        stack_.insert(stack_.end() + n, 1, old_tos);
+      }
+    } else if (n >= int64_t(stack_.size())) {
+      Push(0.);
+    } else if (n > 0) {
+      std::size_t idx = stack_.size() - n - 1;
+      double val = stack_[idx];
+      stack_.erase(stack_.begin() + idx);
+      Push(val);
+    }
+  }
+
+  // The most that FormatLn() writes: a sign, 6 digits, a decimal point, a
+  // 5-character exponent and a newline, with room to spare.
+  static constexpr std::size_t kMaxFormatLn = 32;
+  static constexpr std::size_t kOutputBufSize = std::size_t(1) << 16;
+
+  // Formats a value and a newline, just as `std::cout << val << '\n'` does
+  // with the default precision, into [first, first + kMaxFormatLn).
+  // Returns the end of the text.
+  static char* FormatLn(char* first, ValueType val) {
+    char* const last = std::to_chars(first, first + kMaxFormatLn - 1, val,
+                                     std::chars_format::general, 6).ptr;
+    *last = '\n';
+    return last + 1;
+  }
+
+  // Writes a little-endian 64-bit integer to `out`.  Returns the end.
+  static char* PutLe64(char* out, std::uint64_t bits) {
+    for (int i = 0; i != 8; ++i) {
+      out[i] = static_cast<char>(bits >> (8 * i));
+    }
+    return out + 8;
+  }
+
+  // Prints the argument, which the instruction at `insn` prints, in the
+  // output format.  This only formats it into the output buffer, or queues
+  // it for the output thread.  The run writes the buffer out when it fills
+  // up, and before returning.  This and FlushOutput() are defined after
+  // AsyncOutput.
+  inline void PrintLn(ValueType val, const Insn* insn);
+
+  // Where the VM writes messages about the run: along with the program's
+  // output when that's text, or else to std::cerr.
+  std::ostream& Messages() {
+    return out_format_ == OutputFormat::kText ? *out_ : std::cerr;
+  }
+
+  // Writes out the output buffer, and waits for the output thread to write
+  // out everything queued.
+  inline void FlushOutput();
+
+  // Makes room in the output buffer, allocating it on first use.
+  inline void MakeOutputRoom();
+
+  // Flatten whitespace down to ' '.
+  static ByteType FixWs(ByteType bc) {
+    return std::isspace(bc) ? ' ' : bc;
+  }
+
+  // Reads a byte of program text.  Line breaks read as spaces, for arguments
+  // as well as bytecodes, so a program's lines run as one.
+  static ByteType ReadByte(char byte) {
+    return byte == '\n' ? ' ' : byte;
+  }
+
+  using DblFxn1 = double(double);
+  using DblFxn2 = double(double, double);
+
+  // Helper template for one-operand bytecodes.
+  template <typename Callable>
+  void OneOp(Callable fxn) {
+    Top() = fxn(Top());
+  }
+
+  // Helper template for two-operand bytecodes.
+  template <typename Callable>
+  void TwoOp(Callable fxn) {
+    auto rhs = Pop();
+    Top() = fxn(Top(), rhs);
+  }
+
+  // Helper template for two-operand bytecodes.
+  template <typename Callable>
+  void TwoOpUint(Callable fxn) {
+    auto rhs = Pop();
+    Top() = fxn(Uint(Top()), Uint(rhs));
+  }
+
+  // Helper templates for the fast run loops, as above.
+  template <typename Callable>
+  static void OneOp(Regs& r, Callable fxn) {
+    r.tos = fxn(r.tos);
+  }
+
+  template <typename Callable>
+  void TwoOp(Regs& r, Callable fxn) {
+    auto rhs = Pop(r);
+    r.tos = fxn(r.tos, rhs);
+  }
+
+  template <typename Callable>
+  void TwoOpUint(Regs& r, Callable fxn) {
+    auto rhs = Pop(r);
+    r.tos = fxn(Uint(r.tos), Uint(rhs));
+  }
+
+  // Gets the number of steps an opcode accounts for.  Superinstructions count
+  // the steps of the bytecodes they replace, so GetSteps() doesn't change.
+  static constexpr int64_t StepsFor(Op op) {
+    switch (op) {
+      case kOpStop: return 0;
+      case kOpSquare: return 3;
+      case kOpLitAdd: case kOpLitSub: case kOpLitMul: case kOpLitDiv:
+      case kOpLitDropN: case kOpLitRotate: case kOpLitCall: case kOpLitGoto:
+      case kOpDupIf: case kOpSwapIf: case kOpPrintDrop: return 2;
+      default: return 1;
+    }
+  }
+
+#if VM_COMPILER
+  std::vector<std::size_t> Successors(std::size_t i, bool& dynamic) const;
+#endif
+
+  static Op Decode(int code);
+
+  Regs LoadRegs();
+  inline void StoreRegs(const Regs& r);
+  inline void GrowStack(Regs& r, std::size_t min_size = 0,
+                        std::size_t min_below = 0);
+  inline void DropN(Regs& r, int64_t n);
+  inline void Rotate(Regs& r, int64_t n);
+  inline const Insn* Execute(Op op, const Insn* ip, Regs& r);
+  template <bool kLimited = false, bool kSampled = false>
+  void RunSwitch(int64_t max_steps = kNoStepLimit);
+  class Batch;
+#if VM_STENCILS
+  template <Op op>
+  static void Stencil(void* vm, ValueType* sp, int64_t steps, ValueType tos);
+  static VmStencilFxn* const kStencilTable[kNumOps];
+#endif
+#if VM_JIT
+  class JitAssembler;
+  class Jit;
+  class Trace;
+  class Tracer;
+#if VM_COPY_PATCH
+  class CopyPatch;
+#endif
+  // Each JIT is only complete in its own file, vm_jit.cc or
+  // vm_copy_patch.cc, which defines how to delete it.
+  struct JitDeleter {
+    void operator()(Jit* jit) const;
+    void operator()(Tracer* tracer) const;
+#if VM_COPY_PATCH
+    void operator()(CopyPatch* copy_patch) const;
+#endif
+  };
+#endif
+#if VM_JIT && VM_COPY_PATCH
+  std::unique_ptr<CopyPatch, JitDeleter> copy_patch_;
+#endif
+#if VM_JIT
+  std::unique_ptr<Jit, JitDeleter> jit_;
+  std::unique_ptr<Tracer, JitDeleter> tracer_;
+#endif
+#if VM_THREADED_DISPATCH
+  void RunThreaded();
+#endif
+#if VM_SAMPLING
+  // The samples, each the PCs of the `C`s on the stack, from the bottom up,
+  // and then where the run was, with the number of times each was taken.
+  std::map<std::vector<LocType>, int64_t> samples_{};
+  int sample_hz_ = 0;
+  // Raised by SIGPROF, and lowered by the run that takes the sample.
+  static inline std::atomic<bool> sample_due_{false};
+
+  void RunSampled();
+  void Sample(const Insn* ip, const Regs& r);
+#endif
+#if VM_PROFILE
+  // What RunProfiled() saw of an instruction: how many times it ran, and the
+  // cycles it took, by PC.
+  struct InsnProfile {
+    int64_t runs = 0;
+    std::uint64_t cycles = 0;
+  };
+  std::vector<InsnProfile> profile_{};
+
+  static std::uint64_t ReadCycles();
+  void RunProfiled();
+#endif
+#if VM_TAILCALL_DISPATCH
+  // Tail-call handlers take the machine state as arguments, so that it stays
+  // in argument registers from one handler to the next.
+  using TailCallFxn = void(VM* vm, const Insn* ip, ValueType* sp,
+                           ValueType tos, int64_t steps);
+  static TailCallFxn* const kTailCalls[kNumOps];
+
+  template <Op op>
+  static void TailCall(VM* vm, const Insn* ip, ValueType* sp, ValueType tos,
+                       int64_t steps);
+  static void TailCallFinish(VM* vm, const Insn* ip, ValueType* sp,
+                             ValueType tos, int64_t steps);
+  void RunTailCall();
+
+#ifndef VM_MUSTTAIL
+  // Where handlers leave the machine state for the trampoline in
+  // RunTailCall(), when tail calls aren't guaranteed.
+  struct Bounce {
+    const Insn* ip;
+    Regs r;
+    int64_t steps;
+  } bounce_{};
+#endif
+#endif
+};
+
+class VM::Program {
+ public:
+  explicit Program(std::string_view prog) : text_(prog) {
+    prog_ = text_;
+    Build();
+  }
+
+  // Maps a program's text from a file, and prescans it in place, without
+  // copying it.  Returns nullptr if `path` can't be read.
+  [[maybe_unused]] static std::shared_ptr<const Program> MapText(
+      const char* path);
+
+  // Maps a precompiled image that WriteImage() wrote.  Returns nullptr if
+  // `path` can't be read, or isn't an image this build can run.
+  [[maybe_unused]] static std::shared_ptr<const Program> MapImage(
+      const char* path);
+
+  // Writes the program out as a precompiled image: its translation, call
+  // sites, global labels and text, which VMs run in place once MapImage()
+  // maps them.  Images are in this machine's byte order, and depend on
+  // this VM's version.
+  [[maybe_unused]] void WriteImage(std::ostream& out) const;
+
+ private:
+  friend class VM;
+
+  struct ImageHeader;
+
+  Program() = default;
+
+  // The translation and call sites that VMs run.  These are the members
+  // below, or the mapped image's.
+  Span<Insn> Code() const {
+    return image_code_.size() ? image_code_ : Span<Insn>(code_);
+  }
+  Span<LocType> CallSites() const {
+    return image_code_.size() ? image_call_sites_ : Span<LocType>(call_sites_);
+  }
+
+  // As VM::ByteAt().
+  ByteType ByteAt(LocType loc) const {
+    if (loc < 0 || loc >= LocType(prog_.size())) {
+      return kTerminateByte;
+    }
+    return ReadByte(prog_[loc]);
+  }
+
+  // Gets the PC following a bytecode at `loc` that takes a one-byte argument.
+  // An argument past the end of the program reads as `X`, and isn't skipped.
+  LocType ArgNext(LocType loc) const {
+    return loc + 1 < LocType(prog_.size()) ? loc + 2 : loc + 1;
+  }
+
+  // A run of literal bytecodes, digits and '.', from `begin` to `end`.  For
+  // each byte, the next '.' and the next byte other than '0', or `end`.
+  // GetNumber() uses these to skip digits that can no longer change the
+  // value, so that decoding every suffix of a run takes linear time.
+  struct LiteralRun {
+    void Scan(const Program& program, LocType start);
+    LocType NextPoint(LocType loc) const {
+      return loc < end ? next_point[loc - begin] : end;
+    }
+    LocType NextNonZero(LocType loc) const {
+      return loc < end ? next_nonzero[loc - begin] : end;
+    }
+
+    LocType begin = 0;
+    LocType end = 0;
+    std::vector<LocType> next_point{};
+    std::vector<LocType> next_nonzero{};
+  };
+
+  std::pair<ValueType, LocType> GetNumber(LocType loc,
+                                          const LiteralRun* run = nullptr);
+  void Build();
+  void Prescan();
+  void Translate();
+  void Fuse();
+
+  // The program's text, in `text_` or in `file_`.
+  std::string_view prog_{};
+  std::string text_{};
+  // The file that the text or image is mapped from, if any.
+  std::unique_ptr<const MappedFile> file_{};
+  // The prescanner's branch targets and predecoded literals, by location.
+  // These are dense, as the translator decodes a literal at every location
+  // where one starts, including the middle of another literal.  Build()
+  // frees them once the translation is done.
+  std::vector<LocType> branch_target_{};
+  std::vector<Insn> code_{};
+  std::vector<ValueType> predec_values_{};
+  std::vector<bool> predecoded_{};
+  LabelTable global_label_{};
+  // The PC of each `C` and `G`, in program order.  Each VM gives each one an
+  // inline cache, which its instruction's `target` indexes.
+  std::vector<LocType> call_sites_{};
+  // A mapped image's translation and call sites, which VMs run in place of
+  // `code_` and `call_sites_`.
+  Span<Insn> image_code_{};
+  Span<LocType> image_call_sites_{};
+};
+
+void VM::MakeOutputRoom() {
+  FlushOutput();
+  if (!out_buf_) {
+    out_buf_ = std::make_unique<char[]>(kOutputBufSize);
+    out_pos_ = out_buf_.get();
+    out_limit_ = out_pos_ + kOutputBufSize - kMaxFormatLn;
+  }
+}
+
+#if VM_ASYNC_OUTPUT
+// An output thread.  The VM pushes the values it prints onto a ring, which
+// only it writes `head_` of, and the thread pops them off, which only it
+// writes `tail_` of, so neither side takes a lock.  The thread formats the
+// values, in order, into blocks of text, which it writes to the VM's output
+// stream.
+//
+// A side with nothing to do raises its flag, checks again, and sleeps on
+// its semaphore.  The other side checks the flag after publishing its
+// progress, and posts the semaphore if it lowers the flag, so one of them
+// always sees the other's store, and a post that comes early isn't lost.
+class VM::AsyncOutput {
+ public:
+  explicit AsyncOutput(VM& vm)
+      : vm_(vm), ring_(std::make_unique<ValueType[]>(kRingSize)) {
+    sem_init(&vm_wake_, 0, 0);
+    sem_init(&writer_wake_, 0, 0);
+    thread_ = std::thread(&AsyncOutput::Write, this);
+  }
+
+  ~AsyncOutput() {
+    stop_.store(true);
+    WakeWriter();
+    thread_.join();
+    sem_destroy(&writer_wake_);
+    sem_destroy(&vm_wake_);
+  }
+
+  AsyncOutput(const AsyncOutput&) = delete;
+  AsyncOutput& operator=(const AsyncOutput&) = delete;
+
+  // Queues a value to print.  This only waits if the ring is full.
+  void Push(ValueType val) {
+    if (head_ - tail_seen_ == kRingSize) {
+      MakeRoom();
+    }
+    ring_[head_ % kRingSize] = val;
+    head_shared_.store(++head_);
+    if (writer_idle_.load()) {
+      WakeWriter();
+    }
+  }
+
+  // Waits until everything queued has been written to the VM's output.
+  void Drain() {
+    WaitForWriter([this] { return written_.load() == head_; });
+  }
+
+ private:
+  static constexpr std::size_t kRingSize = std::size_t(1) << 16;
+  static constexpr std::size_t kBatch = kRingSize / 8;  // Values per pop.
+
+  static void Sleep(sem_t* wake) {
+    while (sem_wait(wake) != 0) {  // Only fails if a signal interrupts it.
+    }
+  }
+
+  // Waits for the output thread to free up room in the ring.
+  void MakeRoom() {
+    WaitForWriter([this] {
+      tail_seen_ = tail_.load();
+      return head_ - tail_seen_ != kRingSize;
+    });
+  }
+
+  // Sleeps until `done()`, which the output thread's progress makes true.
+  template <typename Done>
+  void WaitForWriter(Done done) {
+    while (!done()) {
+      vm_waiting_.store(true);
+      if (done()) {
+        if (!vm_waiting_.exchange(false)) {
+          Sleep(&vm_wake_);  // Take the post that's on its way.
+        }
+        return;
+      }
+      Sleep(&vm_wake_);
+    }
+  }
+
+  void WakeWriter() {
+    if (writer_idle_.exchange(false)) {
+      sem_post(&writer_wake_);
+    }
+  }
+
+  void WakeVm() {
+    if (vm_waiting_.load() && vm_waiting_.exchange(false)) {
+      sem_post(&vm_wake_);
+    }
+  }
+
+  void Write();
+
+  VM& vm_;
+  const std::unique_ptr<ValueType[]> ring_;
+  // The VM's side.
+  std::size_t head_ = 0;
+  std::size_t tail_seen_ = 0;  // The last tail_ the VM saw.
+  alignas(64) std::atomic<std::size_t> head_shared_{0};
+  std::atomic<bool> vm_waiting_{false};
+  std::atomic<bool> stop_{false};
+  sem_t vm_wake_;
+  // The output thread's side.
+  alignas(64) std::atomic<std::size_t> tail_{0};
+  std::atomic<std::size_t> written_{0};  // Popped, and written out.
+  std::atomic<bool> writer_idle_{false};
+  sem_t writer_wake_;
+  std::thread thread_;
+};
+
+#endif  // VM_ASYNC_OUTPUT
+
+void VM::PrintLn(ValueType val, const Insn* insn) {
+#if VM_ASYNC_OUTPUT
+  if (async_out_) {
+    async_out_->Push(val);
+    return;
+  }
+#endif
+  if (out_pos_ >= out_limit_) {  // Also true before the first print.
+    MakeOutputRoom();
+  }
+  switch (out_format_) {
+    case OutputFormat::kText: {
+      out_pos_ = FormatLn(out_pos_, val);
+      break;
+    }
+    case OutputFormat::kBinaryWithPc: {
+      out_pos_ = PutLe64(out_pos_, insn->target);
+      [[fallthrough]];
+    }
+    case OutputFormat::kBinary: {
+      std::uint64_t bits;
+      std::memcpy(&bits, &val, sizeof(bits));
+      out_pos_ = PutLe64(out_pos_, bits);
+      break;
+    }
+  }
+}
+
+void VM::FlushOutput() {
+#if VM_ASYNC_OUTPUT
+  if (async_out_) {
+    async_out_->Drain();
+  }
+#endif
+  if (out_pos_ != out_buf_.get()) {
+    out_->write(out_buf_.get(), out_pos_ - out_buf_.get());
+    out_pos_ = out_buf_.get();
+  }
+}
+
+#if VM_GUARDED_STACK
+VM::StackMapping::StackMapping(std::size_t reserve) {
+  const std::size_t page = sysconf(_SC_PAGESIZE);
+  // Round up to two halves of whole pages.
+  reserve = (reserve + 2 * page - 1) & ~(2 * page - 1);
+  size_ = page + reserve + page;
+  addr_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr_ == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  auto* const bytes = static_cast<unsigned char*>(addr_);
+  mprotect(bytes, page, PROT_READ);
+  mprotect(bytes + size_ - page, page, PROT_NONE);
+  page_ = page;
+  floor_ = reinterpret_cast<ValueType*>(bytes + page);
+  limit_ = reinterpret_cast<ValueType*>(bytes + size_ - page);
+  base_ = floor_ + (limit_ - floor_) / 2;
+}
+
+VM::StackMapping::~StackMapping() {
+  munmap(addr_, size_);
+}
+
+void VM::StackMapping::Clear(ValueType* from, ValueType* to) const {
+  const auto first = (reinterpret_cast<std::uintptr_t>(from) + page_ - 1) &
+                     ~std::uintptr_t(page_ - 1);
+  const auto last = reinterpret_cast<std::uintptr_t>(to) &
+                    ~std::uintptr_t(page_ - 1);
+  if (first >= last) {
+    std::fill(from, to, 0.);
+    return;
+  }
+  std::fill(from, reinterpret_cast<ValueType*>(first), 0.);
+  madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+  std::fill(reinterpret_cast<ValueType*>(last), to, 0.);
+}
+#endif
+
+// Stores the registers back to `stack_` when a fast run loop finishes.  The
+// TOS always goes back too, as an empty stack and a 0 alone on it look the
+// same in registers.
+void VM::StoreRegs(const Regs& r) {
+  stack_.assign(stack_base_, r.sp);
+  stack_.push_back(r.tos);
+#if VM_GUARDED_STACK
+  // Restore the 0s below where the next run's stack starts.
+  if (stack_base_ < stack_mapping_->base()) {
+    stack_mapping_->Clear(stack_base_, stack_mapping_->base());
+  }
+#endif
+  stack_floor_ = stack_base_ = stack_limit_ = nullptr;
+}
+
+// Makes room on the stack in a fast run loop, for at least `min_size` items,
+// and at least one more push.  This at least doubles the stack's size.  The
+// guarded stack moves to a new mapping, at least twice as big, at the same
+// offset from its base, so the floor below it keeps reading as 0s.  It can
+// also make room for `min_below` items below the bottom of the stack, for
+// Rotate().
+void VM::GrowStack(Regs& r, std::size_t min_size,
+                   [[maybe_unused]] std::size_t min_below) {
+#if VM_GUARDED_STACK
+  const std::size_t depth = r.sp - stack_base_;
+  if (r.sp != stack_limit_ &&
+      min_size <= std::size_t(stack_limit_ - stack_base_) &&
+      min_below <= std::size_t(stack_base_ - stack_floor_)) {
+    return;
+  }
+  // Either half of the new mapping must fit the items below its base, and
+  // whichever of the stack or the room under it needs more.
+  const std::size_t below = stack_mapping_->base() - stack_base_;
+  const std::size_t items = std::max(min_size, min_below) + depth + 1;
+  if (items > std::numeric_limits<std::size_t>::max() / 8 / sizeof(ValueType)
+                  - below) {
+    throw std::bad_alloc();
+  }
+  const std::size_t needed = (below + items) * sizeof(ValueType);
+  std::size_t reserve = 2 * stack_mapping_->reserve();
+  while (reserve / 2 < needed) {
+    reserve *= 2;
+  }
+  auto mapping = std::make_unique<StackMapping>(reserve);
+  ValueType* const base = mapping->base() - below;
+  std::copy(stack_base_, r.sp, base);
+  stack_mapping_ = std::move(mapping);
+  stack_floor_ = stack_mapping_->floor();
+  stack_base_ = base;
+  stack_limit_ = stack_mapping_->limit();
+  r.sp = base + depth;
+#else
+  const auto depth = r.sp - stack_base_;
+  const auto base = stack_base_ - stack_floor_;
+  const std::size_t size = stack_limit_ - stack_base_;
+  stack_mem_.resize(1 + base + std::max(size * 2, min_size));
+  stack_floor_ = stack_mem_.data() + 1;
+  stack_base_ = stack_floor_ + base;
+  stack_limit_ = stack_mem_.data() + stack_mem_.size();
+  r.sp = stack_base_ + depth;
+#endif
+}
+
+// Drops the top N elements of the stack in a fast run loop.
+void VM::DropN(Regs& r, int64_t n) {
+  if (n <= 0) {
+    return;
+  }
+  if (n > r.sp - stack_base_) {
+    r.sp = stack_base_;
+    r.tos = 0.;
+    return;
+  }
+  r.sp -= n;
+  r.tos = *r.sp;
+}
+
+// Rotates the top N elements of the stack in a fast run loop.  See the
+// vector-based Rotate() for the semantics.
+//
+// Rotating moves the items on one side of the rotated item by one slot.
+// This moves whichever side is shorter, moving the bottom of the stack when
+// that's the side that moves, so a rotation costs O(min(n, depth - n)).
+// Rotating down past the bottom only has to store the item below the
+// bottom, as the slots in between already read as 0.  In the guarded stack,
+// those 0s stay virtual: they're the kernel's zero pages until something
+// writes them.  With no room below the bottom, this reifies the 0s instead.
+void VM::Rotate(Regs& r, int64_t n) {
+  const auto room_below = uint64_t(stack_base_ - stack_floor_);
+
+  if (n < 0) {
+    const auto old_tos = Pop(r);
+    const auto pn = uint64_t(0) - uint64_t(n);
+    auto depth = uint64_t(r.sp - stack_base_) + 1;  // Including TOS.
+
+#if VM_GUARDED_STACK
+    // Rather than reify the 0s, make room for them below.
+    if (pn >= depth && pn - depth >= room_below) {
+      GrowStack(r, 0, pn - depth + 1);
+    }
+#endif
+    if (pn >= depth && pn - depth < uint64_t(stack_base_ - stack_floor_)) {
+      stack_base_ -= pn - depth + 1;
+      *stack_base_ = old_tos;
+      return;
+    }
+
+    if (pn < depth && depth - pn < pn && room_below != 0) {
+      // Move the items below the insertion point down.
+      ValueType* const ins = stack_base_ + depth - pn;
+      std::copy(stack_base_, ins, stack_base_ - 1);
+      --stack_base_;
+      ins[-1] = old_tos;
+      return;
+    }
+
+    if (std::max(depth, pn) + 1 > std::size_t(stack_limit_ - stack_base_)) {
+      GrowStack(r, std::max(depth, pn) + 1);
+    }
+    *r.sp = r.tos;  // Spill TOS, so the whole stack is in memory.
+
+    if (pn > depth) {
+      std::copy_backward(stack_base_, stack_base_ + depth,
+                         stack_base_ + pn);
+      std::fill(stack_base_, stack_base_ + pn - depth, 0.);
+      depth = pn;
+    }
+
+    // Move the items above the insertion point up.
+    ValueType* const ins = stack_base_ + depth - pn;
+    std::copy_backward(ins, stack_base_ + depth, stack_base_ + depth + 1);
+    *ins = old_tos;
+    r.sp = stack_base_ + depth;
+    r.tos = *r.sp;
+  } else if (n > r.sp - stack_base_) {
+    Push(r, 0.);
+  } else if (n > 0) {
+    ValueType* const src = r.sp - n;
+    const auto val = *src;
+
+    if (src - stack_base_ < n) {
+      // Move the items below it up, and 0 the slot that leaves the stack.
+      std::copy_backward(stack_base_, src, src + 1);
+      *stack_base_++ = 0.;
+      Push(r, val);
+      return;
+    }
+
+    // Move the items above it down.
+    if (r.sp == stack_limit_) {
+      GrowStack(r);
+    }
+    *r.sp = r.tos;  // Spill TOS, so the whole stack is in memory.
+    std::copy(src + 1, r.sp + 1, src);
+    r.tos = val;
+  }
+}
+
+// Executes the instruction at `ip` as opcode `op`, updating the registers in
+// `r`, and returns the next instruction to execute.  The fast run loops call
+// this with a constant `op`, so inlining boils it down to one opcode's
+// handler.  This mirrors the `switch` in Step().
+[[gnu::always_inline]] inline const VM::Insn* VM::Execute(
+    Op op, const Insn* ip, Regs& r) {
+  switch (op) {
+    case kOpHalt: case kOpStop: { return ip; }
+
+    case kOpLiteral: { Push(r, ip->val); return At(ip->next); }
+    case kOpPushVar: { Push(r, GetV(ip->reg)); return code_.data() + ip->next; }
+
+    case kOpAdd: { TwoOp(r, std::plus()); return ip + 1; }
+    case kOpSub: { TwoOp(r, std::minus()); return ip + 1; }
+    case kOpMul: { TwoOp(r, std::multiplies()); return ip + 1; }
+    case kOpDiv: { TwoOp(r, std::divides()); return ip + 1; }
+    case kOpNeg: { OneOp(r, std::negate()); return ip + 1; }
+    case kOpMod: { TwoOp<DblFxn2>(r, std::fmod); return ip + 1; }
+    case kOpAnd: { TwoOpUint(r, std::bit_and()); return ip + 1; }
+    case kOpOr: { TwoOpUint(r, std::bit_or()); return ip + 1; }
+    case kOpXor: { TwoOpUint(r, std::bit_xor()); return ip + 1; }
+    case kOpShl: {
+      OneOp<DblFxn1>(r, std::exp2);
+      TwoOp(r, std::multiplies());
+      return ip + 1;
+    }
+    case kOpShr: {
+      OneOp<DblFxn1>(r, std::exp2);
+      TwoOp(r, std::divides());
+      return ip + 1;
+    }
+    case kOpPrintTop: { PrintLn(r.tos, ip); return ip + 1; }
+    case kOpPrintVar: { PrintLn(GetV(ip->reg), ip); return ip + 2; }
+    case kOpCall: {
+      auto dst = Resolve(Pop(r), call_cache_[ip->target]);
+      Push(r, ~ip->next);
+      return At(dst);
+    }
+    case kOpGoto: { return At(Resolve(Pop(r), call_cache_[ip->target])); }
+    case kOpInt: { r.tos = Int(r.tos); return ip + 1; }
+    case kOpUint: { r.tos = Uint(r.tos); return ip + 1; }
+    case kOpStore: { SetV(ip->reg, Pop(r)); return ip + 2; }
+    case kOpDup: { Push(r, r.tos); return ip + 1; }
+    case kOpDrop: { Pop(r); return ip + 1; }
+    case kOpDropN: { DropN(r, Nat(Pop(r))); return ip + 1; }
+    case kOpRotate: { Rotate(r, Int(Pop(r))); return ip + 1; }
+    case kOpSwap: {
+      if (r.sp != stack_base_) {
+        std::swap(r.tos, r.sp[-1]);
+      } else {
+        Push(r, 0.);
+      }
+      return ip + 1;
+    }
+    case kOpIf: { return Pop(r) < 0 ? At(ip->target) : ip + 1; }
+    case kOpJump: { return At(ip->target); }
+
+    // Library escapes.  These are two bytes long.
+    case kOpEscPow: { TwoOp<DblFxn2>(r, std::pow); return ip + 2; }
+    case kOpEscHypot: { TwoOp<DblFxn2>(r, std::hypot); return ip + 2; }
+    case kOpEscHypot3: {
+      auto x = Pop(r), y = Pop(r);
+      r.tos = std::hypot(r.tos, y, x);
+      return ip + 2;
+    }
+    case kOpEscAtan2: { TwoOp<DblFxn2>(r, std::atan2); return ip + 2; }
+    case kOpEscSin: { OneOp<DblFxn1>(r, std::sin); return ip + 2; }
+    case kOpEscAsin: { OneOp<DblFxn1>(r, std::asin); return ip + 2; }
+    case kOpEscCos: { OneOp<DblFxn1>(r, std::cos); return ip + 2; }
+    case kOpEscAcos: { OneOp<DblFxn1>(r, std::acos); return ip + 2; }
+    case kOpEscTan: { OneOp<DblFxn1>(r, std::tan); return ip + 2; }
+    case kOpEscAtan: { OneOp<DblFxn1>(r, std::atan); return ip + 2; }
+    case kOpEscSinh: { OneOp<DblFxn1>(r, std::sinh); return ip + 2; }
+    case kOpEscAsinh: { OneOp<DblFxn1>(r, std::asinh); return ip + 2; }
+    case kOpEscCosh: { OneOp<DblFxn1>(r, std::cosh); return ip + 2; }
+    case kOpEscAcosh: { OneOp<DblFxn1>(r, std::acosh); return ip + 2; }
+    case kOpEscTanh: { OneOp<DblFxn1>(r, std::tanh); return ip + 2; }
+    case kOpEscAtanh: { OneOp<DblFxn1>(r, std::atanh); return ip + 2; }
+    case kOpEscErf: { OneOp<DblFxn1>(r, std::erf); return ip + 2; }
+    case kOpEscErfc: { OneOp<DblFxn1>(r, std::erfc); return ip + 2; }
+    case kOpEscTgamma: { OneOp<DblFxn1>(r, std::tgamma); return ip + 2; }
+    case kOpEscLgamma: { OneOp<DblFxn1>(r, std::lgamma); return ip + 2; }
+    case kOpEscExp: { OneOp<DblFxn1>(r, std::exp); return ip + 2; }
+    case kOpEscLog: { OneOp<DblFxn1>(r, std::log); return ip + 2; }
+    case kOpEscLog2: { OneOp<DblFxn1>(r, std::log2); return ip + 2; }
+    case kOpEscSqrt: { OneOp<DblFxn1>(r, std::sqrt); return ip + 2; }
+    case kOpEscCbrt: { OneOp<DblFxn1>(r, std::cbrt); return ip + 2; }
+    case kOpEscCeil: { OneOp<DblFxn1>(r, std::ceil); return ip + 2; }
+    case kOpEscFloor: { OneOp<DblFxn1>(r, std::floor); return ip + 2; }
+    case kOpEscTrunc: { OneOp<DblFxn1>(r, std::trunc); return ip + 2; }
+    case kOpEscAbs: { OneOp<DblFxn1>(r, std::abs); return ip + 2; }
+    case kOpEscRound: { OneOp<DblFxn1>(r, std::round); return ip + 2; }
+    case kOpEscNearbyInt: { OneOp<DblFxn1>(r, std::nearbyint); return ip + 2; }
+    case kOpEscFrexp: {
+      int exp;
+      r.tos = std::frexp(r.tos, &exp);
+      Push(r, exp);
+      return ip + 2;
+    }
+    case kOpEscLdexp: {
+      TwoOp<double(double,int)>(r, std::ldexp);
+      return ip + 2;
+    }
+    case kOpEscModf: {
+      double int_part;
+      r.tos = std::modf(r.tos, &int_part);
+      Push(r, int_part);
+      return ip + 2;
+    }
+    case kOpEscSignBit: { OneOp<bool(double)>(r, std::signbit); return ip + 2; }
+    case kOpEscCopySign: { TwoOp<DblFxn2>(r, std::copysign); return ip + 2; }
+
+    case kOpUndefined: {
+      FlushOutput();
+      Messages() << "Undefined bytecode '" << ip->code << "' at "
+                 << ip->next - 1 << ". Terminating.\n";
+      pc_ = ip->next;
+      return &code_.back();  // kOpStop
+    }
+
+    // Superinstructions.  The literal forms find the fused bytecode at the
+    // literal's `next`, which Fuse() guarantees is in range.
+    case kOpLitAdd: { r.tos += ip->val; return code_.data() + ip->next + 1; }
+    case kOpLitSub: { r.tos -= ip->val; return code_.data() + ip->next + 1; }
+    case kOpLitMul: { r.tos *= ip->val; return code_.data() + ip->next + 1; }
+    case kOpLitDiv: { r.tos /= ip->val; return code_.data() + ip->next + 1; }
+    case kOpLitDropN: {
+      DropN(r, Nat(ip->val));
+      return code_.data() + ip->next + 1;
+    }
+    case kOpLitRotate: {
+      Rotate(r, Int(ip->val));
+      return code_.data() + ip->next + 1;
+    }
+    case kOpLitCall: { Push(r, ~(ip->next + 1)); return At(ip->target); }
+    case kOpLitGoto: { return At(ip->target); }
+    case kOpDupIf: { return r.tos < 0 ? At(ip[1].target) : ip + 2; }
+    case kOpSwapIf: {
+      const ValueType nos = r.sp[-1];
+      r.sp = std::max(r.sp - 1, stack_base_);
+      return nos < 0 ? At(ip[1].target) : ip + 2;
+    }
+    case kOpSquare: { Push(r, r.tos * r.tos); return ip + 3; }
+    case kOpPrintDrop: { PrintLn(r.tos, ip); Pop(r); return ip + 2; }
+
+    case kNumOps: break;
+  }
+  return ip;
+}
+
+}  // namespace simplevm::internal
+
+#endif  // VM_INTERNAL_H_
@@ -0,0 +1,903 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// The x86-64 JITs: the baseline JIT, which compiles the whole program to
+// native code up front, and the tracing JIT, which compiles the hot paths
+// around loops as it finds them.  Both emit code with JitAssembler.
+
+#include "vm_internal.h"
+
+namespace simplevm::internal {
+
+#if VM_JIT
+// Native code generation for x86-64, shared by the baseline JIT and the
+// tracing JIT.  EmitInsn() compiles one pre-decoded instruction to a fixed
+// template of native code.  The common stack and arithmetic opcodes are
+// compiled inline.  Everything else calls out to Execute(), via Helper(), so
+// it shares its semantics with the interpreters.  Subclasses decide where
+// control goes after each instruction.
+//
+// Register assignments, all callee-saved so they survive calls to C++:
+//   rbx    State*
+//   r12    Regs::sp
+//   r13    stack_base_
+//   r14    stack_limit_
+//   r15    step count
+//   xmm0   Regs::tos
+//
+// The generated code embeds the addresses of this VM's registers and
+// instructions, so native code belongs to the VM that compiled it.
+class VM::JitAssembler {
+ public:
+  JitAssembler(const JitAssembler&) = delete;
+  JitAssembler& operator=(const JitAssembler&) = delete;
+
+  // Returns true if Finalize() could make the code executable.
+  bool Ok() const { return mem_ != nullptr; }
+
+ protected:
+  // Machine state shared between the native code and C++.  The native code
+  // only keeps this up to date across calls to C++, and on exit.
+  struct State {
+    ValueType* sp;
+    ValueType tos;
+    ValueType* base;
+    ValueType* limit;
+    int64_t steps;
+    VM* vm;
+    const Insn* exit;  // Where to resume, after a side exit.
+  };
+
+  static constexpr int kSp = offsetof(State, sp);
+  static constexpr int kTos = offsetof(State, tos);
+  static constexpr int kBase = offsetof(State, base);
+  static constexpr int kLimit = offsetof(State, limit);
+  static constexpr int kSteps = offsetof(State, steps);
+  static constexpr int kExit = offsetof(State, exit);
+
+  // x86-64 registers, by encoding.
+  enum Reg { kRax = 0, kRcx = 1, kRbx = 3, kR12 = 12, kR13 = 13, kR14 = 14,
+             kR15 = 15 };
+
+  // Condition codes for Jcc.  Inverting the low bit inverts the condition.
+  static constexpr int kCcE = 0x4;
+  static constexpr int kCcNe = 0x5;
+  static constexpr int kCcA = 0x7;
+
+  explicit JitAssembler(VM& vm);
+  virtual ~JitAssembler();
+
+  // Branches to `target` if condition code `cc` holds, or continues to
+  // `next` otherwise.
+  virtual void EmitBranch(int cc, const Insn* target, const Insn* next) = 0;
+
+  // Continues to `target`.
+  virtual void EmitGoto(const Insn* target) = 0;
+
+  // Continues to the instruction in rax, after `C` or `G`.
+  virtual void EmitDynamicGoto() = 0;
+
+  // Emits the native code for one instruction.
+  void EmitInsn(const Insn* ip);
+
+  // Labels are positions in the code, which jumps can refer to before they
+  // are bound.
+  std::size_t NewLabel();
+  void Bind(std::size_t label);
+  void EmitJump(std::size_t label);
+  void EmitJcc(int cc, std::size_t label);
+
+  // Short forward jumps within one template, patched by BindShort().
+  std::size_t EmitShortJump();
+  std::size_t EmitShortJcc(int cc);
+  void BindShort(std::size_t at);
+
+  void Emit(std::initializer_list<int> bytes);
+  void EmitImm32(std::int32_t imm);
+  void EmitImm64(std::uint64_t imm);
+  void EmitMovImm(Reg reg, std::uint64_t imm);
+  void EmitLoad(Reg reg, int disp);
+  void EmitStore(int disp, Reg reg);
+  void EmitLoadRegs();
+  void EmitStoreRegs();
+  void EmitLoadConst(double val);
+  void EmitSteps(int64_t n);
+  void FlushSteps();
+  void EmitPush();
+  void EmitPopRefill();
+  void EmitHelperCall(const Insn* ip);
+  void EmitExit();
+  void EmitSideExit();
+
+  // Copies the code to executable memory, and resolves the labels.  If the
+  // system won't make the copy executable, this leaves Ok() false.
+  void Finalize();
+
+  // Returns the native address of a label, once finalized.
+  const void* Address(std::size_t label) const {
+    return static_cast<const std::uint8_t*>(mem_) + label_[label];
+  }
+
+  // Runs native code at `start`, until it exits.
+  void Enter(State& state, const void* start) const;
+
+  // Returns the index of an instruction in `code_`.
+  std::size_t Index(const Insn* ip) const { return ip - vm_.code_.data(); }
+
+  VM& vm_;
+
+  // Steps executed, but not yet added to r15.  Step counts only have to be
+  // exact where the code leaves straight-line code, so EmitInsn() only
+  // accumulates them here, and subclasses call FlushSteps().
+  int64_t pending_steps_ = 0;
+
+ private:
+  using Entry = void(State* state, const void* start);
+
+  static const Insn* Helper(State* state, const Insn* ip);
+  static void Grow(State* state);
+
+  std::vector<std::uint8_t> buf_;
+  std::vector<std::size_t> label_;      // Offset of each label.
+  std::vector<std::pair<std::size_t, std::size_t>> fixups_;  // Offset, label.
+  std::size_t grow_stub_ = 0;
+  std::size_t exit_stub_ = 0;
+  std::size_t side_exit_stub_ = 0;
+
+  void* mem_ = nullptr;
+  std::size_t mem_size_ = 0;
+};
+
+VM::JitAssembler::JitAssembler(VM& vm) : vm_(vm) {
+  // Prologue, entered as `Entry`.  Five pushes leave the stack 16-byte
+  // aligned for calls.
+  Emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});  // push
+  Emit({0x48, 0x89, 0xFB});  // mov rbx, rdi
+  EmitLoadRegs();
+  EmitLoad(kR15, kSteps);
+  Emit({0xFF, 0xE6});  // jmp rsi
+
+  // Side exit stub.  Records the instruction in rax to resume from, and
+  // falls into the exit stub.
+  side_exit_stub_ = buf_.size();
+  EmitStore(kExit, kRax);
+
+  // Exit stub.  Writes back the registers and returns.
+  exit_stub_ = buf_.size();
+  EmitStoreRegs();
+  EmitStore(kSteps, kR15);
+  Emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});  // pop
+
+  // Stack growth stub, called when a push finds the stack full.
+  grow_stub_ = buf_.size();
+  EmitStoreRegs();
+  Emit({0x48, 0x83, 0xEC, 0x08});  // sub rsp, 8
+  Emit({0x48, 0x89, 0xDF});        // mov rdi, rbx
+  EmitMovImm(kRax, reinterpret_cast<std::uintptr_t>(&Grow));
+  Emit({0xFF, 0xD0});              // call rax
+  Emit({0x48, 0x83, 0xC4, 0x08});  // add rsp, 8
+  EmitLoadRegs();
+  Emit({0xC3});                    // ret
+}
+
+VM::JitAssembler::~JitAssembler() {
+  if (mem_) {
+    munmap(mem_, mem_size_);
+  }
+}
+
+void VM::JitAssembler::Finalize() {
+  for (const auto& [offset, label] : fixups_) {
+    const auto rel = std::int32_t(label_[label] - (offset + 4));
+    std::memcpy(&buf_[offset], &rel, sizeof(rel));
+  }
+
+  mem_size_ = buf_.size();
+  mem_ = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem_ == MAP_FAILED) {
+    mem_ = nullptr;
+    throw std::bad_alloc();
+  }
+  std::memcpy(mem_, buf_.data(), buf_.size());
+  if (mprotect(mem_, mem_size_, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem_, mem_size_);
+    mem_ = nullptr;
+  }
+
+  buf_ = {};
+  fixups_ = {};
+}
+
+void VM::JitAssembler::Enter(State& state, const void* start) const {
+  auto* const entry = reinterpret_cast<Entry*>(mem_);
+  entry(&state, start);
+}
+
+// Executes one instruction for the native code, for the opcodes it doesn't
+// compile inline.  Returns the next instruction.
+const VM::Insn* VM::JitAssembler::Helper(State* state, const Insn* ip) {
+  VM& vm = *state->vm;
+  Regs r{state->sp, state->tos};
+  ip = vm.Execute(ip->op, ip, r);
+  state->sp = r.sp;
+  state->tos = r.tos;
+  state->base = vm.stack_base_;
+  state->limit = vm.stack_limit_;
+  return ip;
+}
+
+// Grows the stack for the native code.
+void VM::JitAssembler::Grow(State* state) {
+  VM& vm = *state->vm;
+  Regs r{state->sp, state->tos};
+  vm.GrowStack(r);
+  state->sp = r.sp;
+  state->base = vm.stack_base_;
+  state->limit = vm.stack_limit_;
+}
+
+std::size_t VM::JitAssembler::NewLabel() {
+  label_.push_back(0);
+  return label_.size() - 1;
+}
+
+void VM::JitAssembler::Bind(std::size_t label) {
+  label_[label] = buf_.size();
+}
+
+// jmp label
+void VM::JitAssembler::EmitJump(std::size_t label) {
+  Emit({0xE9});
+  fixups_.emplace_back(buf_.size(), label);
+  EmitImm32(0);
+}
+
+// jcc label
+void VM::JitAssembler::EmitJcc(int cc, std::size_t label) {
+  Emit({0x0F, 0x80 | cc});
+  fixups_.emplace_back(buf_.size(), label);
+  EmitImm32(0);
+}
+
+// jmp rel8
+std::size_t VM::JitAssembler::EmitShortJump() {
+  Emit({0xEB, 0});
+  return buf_.size() - 1;
+}
+
+// jcc rel8
+std::size_t VM::JitAssembler::EmitShortJcc(int cc) {
+  Emit({0x70 | cc, 0});
+  return buf_.size() - 1;
+}
+
+// Points the short jump whose displacement is at `at` here.
+void VM::JitAssembler::BindShort(std::size_t at) {
+  buf_[at] = std::uint8_t(buf_.size() - (at + 1));
+}
+
+void VM::JitAssembler::Emit(std::initializer_list<int> bytes) {
+  for (int byte : bytes) {
+    buf_.push_back(std::uint8_t(byte));
+  }
+}
+
+void VM::JitAssembler::EmitImm32(std::int32_t imm) {
+  const auto pos = buf_.size();
+  buf_.resize(pos + sizeof(imm));
+  std::memcpy(&buf_[pos], &imm, sizeof(imm));
+}
+
+void VM::JitAssembler::EmitImm64(std::uint64_t imm) {
+  const auto pos = buf_.size();
+  buf_.resize(pos + sizeof(imm));
+  std::memcpy(&buf_[pos], &imm, sizeof(imm));
+}
+
+// mov reg, imm64
+void VM::JitAssembler::EmitMovImm(Reg reg, std::uint64_t imm) {
+  Emit({0x48 | (reg >> 3), 0xB8 + (reg & 7)});
+  EmitImm64(imm);
+}
+
+// mov reg, [rbx + disp]
+void VM::JitAssembler::EmitLoad(Reg reg, int disp) {
+  Emit({0x48 | ((reg >> 3) << 2), 0x8B, 0x43 | ((reg & 7) << 3), disp});
+}
+
+// mov [rbx + disp], reg
+void VM::JitAssembler::EmitStore(int disp, Reg reg) {
+  Emit({0x48 | ((reg >> 3) << 2), 0x89, 0x43 | ((reg & 7) << 3), disp});
+}
+
+// Loads the machine registers from State.
+void VM::JitAssembler::EmitLoadRegs() {
+  EmitLoad(kR12, kSp);
+  Emit({0xF2, 0x0F, 0x10, 0x43, kTos});  // movsd xmm0, [rbx + kTos]
+  EmitLoad(kR13, kBase);
+  EmitLoad(kR14, kLimit);
+}
+
+// Stores the machine registers to State.  Only `sp` and `tos` can change in
+// native code.
+void VM::JitAssembler::EmitStoreRegs() {
+  EmitStore(kSp, kR12);
+  Emit({0xF2, 0x0F, 0x11, 0x43, kTos});  // movsd [rbx + kTos], xmm0
+}
+
+// movq xmm1, imm64, by way of rax.
+void VM::JitAssembler::EmitLoadConst(double val) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &val, sizeof(bits));
+  EmitMovImm(kRax, bits);
+  Emit({0x66, 0x48, 0x0F, 0x6E, 0xC8});  // movq xmm1, rax
+}
+
+// lea r15, [r15 + n], which leaves the flags alone.
+void VM::JitAssembler::EmitSteps(int64_t n) {
+  if (n == 0) {
+    return;
+  }
+  if (n < 128) {
+    Emit({0x4D, 0x8D, 0x7F, int(n)});
+  } else {
+    Emit({0x4D, 0x8D, 0xBF});
+    EmitImm32(std::int32_t(n));
+  }
+}
+
+void VM::JitAssembler::FlushSteps() {
+  EmitSteps(pending_steps_);
+  pending_steps_ = 0;
+}
+
+// Spills TOS in xmm0 to the stack, growing it first if necessary.  This
+// leaves the old TOS in xmm0, for the caller to replace.
+void VM::JitAssembler::EmitPush() {
+  Emit({0x4D, 0x39, 0xF4});  // cmp r12, r14
+  const auto room = EmitShortJcc(kCcNe);
+  Emit({0xE8});              // call grow_stub_
+  EmitImm32(std::int32_t(grow_stub_ - (buf_.size() + 4)));
+  BindShort(room);
+  Emit({0xF2, 0x41, 0x0F, 0x11, 0x04, 0x24});  // movsd [r12], xmm0
+  Emit({0x49, 0x83, 0xC4, 0x08});              // add r12, 8
+}
+
+// Refills TOS in xmm0 from the stack after a pop.  This reads the 0 below
+// the stack if it's empty, and leaves the stack pointer at the bottom.
+void VM::JitAssembler::EmitPopRefill() {
+  Emit({0xF2, 0x41, 0x0F, 0x10, 0x44, 0x24, 0xF8});  // movsd xmm0, [r12-8]
+  Emit({0x49, 0x83, 0xEC, 0x08});                    // sub r12, 8
+  Emit({0x4D, 0x39, 0xEC});                          // cmp r12, r13
+  Emit({0x4D, 0x0F, 0x42, 0xE5});                    // cmovb r12, r13
+}
+
+// Calls Helper() to execute `ip`, leaving the next instruction in rax.
+void VM::JitAssembler::EmitHelperCall(const Insn* ip) {
+  EmitStoreRegs();
+  Emit({0x48, 0x89, 0xDF});  // mov rdi, rbx
+  Emit({0x48, 0xBE});        // mov rsi, imm64
+  EmitImm64(reinterpret_cast<std::uintptr_t>(ip));
+  EmitMovImm(kRax, reinterpret_cast<std::uintptr_t>(&Helper));
+  Emit({0xFF, 0xD0});        // call rax
+  EmitLoadRegs();
+}
+
+// Returns from the native code.
+void VM::JitAssembler::EmitExit() {
+  Emit({0xE9});
+  EmitImm32(std::int32_t(exit_stub_ - (buf_.size() + 4)));
+}
+
+// Returns from the native code, to resume at the instruction in rax.
+void VM::JitAssembler::EmitSideExit() {
+  Emit({0xE9});
+  EmitImm32(std::int32_t(side_exit_stub_ - (buf_.size() + 4)));
+}
+
+// This mirrors Execute().  The tests for `?` leave the flags set for
+// EmitBranch() to use.
+void VM::JitAssembler::EmitInsn(const Insn* ip) {
+  const Insn* const code = vm_.code_.data();
+  const Insn* next = ip + 1;
+
+  pending_steps_ += StepsFor(ip->op);
+
+  switch (ip->op) {
+    case kOpHalt: {
+      FlushSteps();
+      EmitMovImm(kRax, ip->next);
+      EmitMovImm(kRcx, reinterpret_cast<std::uintptr_t>(&vm_.pc_));
+      Emit({0x48, 0x89, 0x01});  // mov [rcx], rax
+      EmitExit();
+      return;
+    }
+    case kOpStop: {
+      FlushSteps();
+      EmitExit();
+      return;
+    }
+
+    case kOpLiteral: {
+      EmitPush();
+      EmitLoadConst(ip->val);
+      Emit({0x66, 0x0F, 0x28, 0xC1});  // movapd xmm0, xmm1
+      next = vm_.At(ip->next);
+      break;
+    }
+
+    case kOpPushVar: {
+      EmitPush();
+      EmitMovImm(kRax, reinterpret_cast<std::uintptr_t>(&vm_.var_[ip->reg]));
+      Emit({0xF2, 0x0F, 0x10, 0x00});  // movsd xmm0, [rax]
+      next = code + ip->next;
+      break;
+    }
+
+    case kOpStore: {
+      EmitMovImm(kRax, reinterpret_cast<std::uintptr_t>(&vm_.var_[ip->reg]));
+      Emit({0xF2, 0x0F, 0x11, 0x00});  // movsd [rax], xmm0
+      EmitPopRefill();
+      next = ip + 2;
+      break;
+    }
+
+    case kOpAdd: case kOpSub: case kOpMul: case kOpDiv: {
+      const int opc = ip->op == kOpAdd ? 0x58 : ip->op == kOpSub ? 0x5C
+                    : ip->op == kOpMul ? 0x59 : 0x5E;
+      Emit({0x66, 0x0F, 0x28, 0xC8});  // movapd xmm1, xmm0
+      EmitPopRefill();
+      Emit({0xF2, 0x0F, opc, 0xC1});   // op xmm0, xmm1
+      break;
+    }
+
+    case kOpLitAdd: case kOpLitSub: case kOpLitMul: case kOpLitDiv: {
+      const int opc = ip->op == kOpLitAdd ? 0x58 : ip->op == kOpLitSub ? 0x5C
+                    : ip->op == kOpLitMul ? 0x59 : 0x5E;
+      EmitLoadConst(ip->val);
+      Emit({0xF2, 0x0F, opc, 0xC1});   // op xmm0, xmm1
+      next = code + ip->next + 1;
+      break;
+    }
+
+    case kOpNeg: {
+      EmitLoadConst(-0.0);
+      Emit({0x66, 0x0F, 0x57, 0xC1});  // xorpd xmm0, xmm1
+      break;
+    }
+
+    case kOpDup: {
+      EmitPush();
+      break;
+    }
+
+    case kOpSquare: {
+      EmitPush();
+      Emit({0xF2, 0x0F, 0x59, 0xC0});  // mulsd xmm0, xmm0
+      next = ip + 3;
+      break;
+    }
+
+    case kOpDrop: {
+      EmitPopRefill();
+      break;
+    }
+
+    case kOpSwap: {
+      Emit({0x4D, 0x39, 0xEC});        // cmp r12, r13
+      const auto empty = EmitShortJcc(kCcE);
+      Emit({0xF2, 0x41, 0x0F, 0x10, 0x4C, 0x24, 0xF8});  // movsd xmm1, [r12-8]
+      Emit({0xF2, 0x41, 0x0F, 0x11, 0x44, 0x24, 0xF8});  // movsd [r12-8], xmm0
+      Emit({0x66, 0x0F, 0x28, 0xC1});  // movapd xmm0, xmm1
+      const auto done = EmitShortJump();
+      BindShort(empty);
+      EmitPush();                      // Swapping with the well of 0s.
+      Emit({0x66, 0x0F, 0x57, 0xC0});  // xorpd xmm0, xmm0
+      BindShort(done);
+      break;
+    }
+
+    case kOpIf: {
+      Emit({0x66, 0x0F, 0x28, 0xC8});  // movapd xmm1, xmm0
+      EmitPopRefill();
+      Emit({0x66, 0x0F, 0x57, 0xD2});  // xorpd xmm2, xmm2
+      Emit({0x66, 0x0F, 0x2E, 0xD1});  // ucomisd xmm2, xmm1
+      EmitBranch(kCcA, vm_.At(ip->target), next);
+      break;
+    }
+
+    case kOpDupIf: {
+      next = ip + 2;
+      Emit({0x66, 0x0F, 0x57, 0xD2});  // xorpd xmm2, xmm2
+      Emit({0x66, 0x0F, 0x2E, 0xD0});  // ucomisd xmm2, xmm0
+      EmitBranch(kCcA, vm_.At(ip[1].target), next);
+      break;
+    }
+
+    case kOpSwapIf: {
+      next = ip + 2;
+      Emit({0x66, 0x0F, 0x57, 0xC9});  // xorpd xmm1, xmm1
+      Emit({0x4D, 0x39, 0xEC});        // cmp r12, r13
+      const auto empty = EmitShortJcc(kCcE);  // Testing a 0 from the well.
+      Emit({0x49, 0x83, 0xEC, 0x08});  // sub r12, 8
+      Emit({0xF2, 0x41, 0x0F, 0x10, 0x0C, 0x24});  // movsd xmm1, [r12]
+      BindShort(empty);
+      Emit({0x66, 0x0F, 0x57, 0xD2});  // xorpd xmm2, xmm2
+      Emit({0x66, 0x0F, 0x2E, 0xD1});  // ucomisd xmm2, xmm1
+      EmitBranch(kCcA, vm_.At(ip[1].target), next);
+      break;
+    }
+
+    case kOpJump: {
+      next = vm_.At(ip->target);
+      break;
+    }
+
+    case kOpLitCall: {
+      EmitPush();
+      EmitLoadConst(ValueType(~(ip->next + 1)));
+      Emit({0x66, 0x0F, 0x28, 0xC1});  // movapd xmm0, xmm1
+      next = vm_.At(ip->target);
+      break;
+    }
+
+    case kOpLitGoto: {
+      next = vm_.At(ip->target);
+      break;
+    }
+
+    // Destinations from the stack are only known at run time.
+    case kOpCall: case kOpGoto: {
+      EmitHelperCall(ip);
+      EmitDynamicGoto();
+      return;
+    }
+
+    // Everything else has a fixed successor.
+    default: {
+      EmitHelperCall(ip);
+      switch (ip->op) {
+        case kOpUndefined: { next = &vm_.code_.back(); break; }
+        case kOpLitDropN: case kOpLitRotate: {
+          next = code + ip->next + 1;
+          break;
+        }
+        case kOpPrintVar: case kOpPrintDrop: { next = ip + 2; break; }
+        default: {
+          if (ip->op >= kOpEscPow && ip->op <= kOpEscCopySign) {
+            next = ip + 2;
+          }
+          break;
+        }
+      }
+      break;
+    }
+  }
+
+  EmitGoto(next);
+}
+
+// A baseline template JIT.  This compiles every instruction in `code_`,
+// including the terminating slots, in order, so every PC has a native entry
+// point, and `C` and `G` can land anywhere through a table lookup.  Branches
+// resolved by the prescan become direct jumps.
+class VM::Jit : public VM::JitAssembler {
+ public:
+  explicit Jit(VM& vm);
+
+  // Runs the program from the VM's current PC until it terminates.
+  void Run();
+
+ private:
+  void EmitBranch(int cc, const Insn* target, const Insn* next) override;
+  void EmitGoto(const Insn* target) override;
+  void EmitDynamicGoto() override;
+
+  const Insn* current_ = nullptr;       // The instruction being compiled.
+  std::vector<const void*> native_;     // Native address of each Insn.
+};
+
+VM::Jit::Jit(VM& vm) : JitAssembler(vm) {
+  static_assert(sizeof(Insn) == 32, "EmitDynamicGoto() assumes this");
+  const std::size_t count = vm_.code_.size();
+
+  // Instruction i's code is at label i.  The table's address is compiled
+  // into the code, so it must not move.
+  native_.resize(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    NewLabel();
+  }
+  for (std::size_t i = 0; i != count; ++i) {
+    Bind(i);
+    current_ = &vm_.code_[i];
+    EmitInsn(current_);
+  }
+
+  Finalize();
+  if (!Ok()) {
+    return;
+  }
+  for (std::size_t i = 0; i != count; ++i) {
+    native_[i] = Address(i);
+  }
+}
+
+void VM::Jit::Run() {
+  const Regs r = vm_.LoadRegs();
+  State state{r.sp, r.tos, vm_.stack_base_, vm_.stack_limit_, vm_.steps_,
+              &vm_, nullptr};
+  Enter(state, native_[Index(vm_.At(vm_.pc_))]);
+  vm_.steps_ = state.steps;
+  vm_.StoreRegs({state.sp, state.tos});
+  vm_.terminate_ = true;
+}
+
+void VM::Jit::EmitBranch(int cc, const Insn* target,
+                         [[maybe_unused]] const Insn* next) {
+  FlushSteps();
+  EmitJcc(cc, Index(target));
+}
+
+void VM::Jit::EmitGoto(const Insn* target) {
+  FlushSteps();
+  if (target != current_ + 1) {
+    EmitJump(Index(target));
+  }
+}
+
+// Jumps to the native code for the instruction in rax.
+void VM::Jit::EmitDynamicGoto() {
+  FlushSteps();
+  EmitMovImm(kRcx, reinterpret_cast<std::uintptr_t>(vm_.code_.data()));
+  Emit({0x48, 0x29, 0xC8});              // sub rax, rcx
+  Emit({0x48, 0xC1, 0xE8, 0x02});        // shr rax, 2 (32-byte Insn)
+  EmitMovImm(kRcx, reinterpret_cast<std::uintptr_t>(native_.data()));
+  Emit({0xFF, 0x24, 0x01});              // jmp [rcx + rax]
+}
+
+// Compiles the program on first use, and runs it.
+bool VM::RunJit() {
+  if (!jit_) {
+    jit_.reset(new Jit(*this));
+  }
+  if (!jit_->Ok()) {
+    return false;
+  }
+  jit_->Run();
+  FlushOutput();
+  return true;
+}
+
+void VM::JitDeleter::operator()(Jit* jit) const {
+  delete jit;
+}
+
+// One compiled trace: the native code for a single hot path around a loop,
+// from its head back to its head.  The trace is straight-line code, which
+// loops back to its start.  It checks that each `?`, `C` and `G` goes the
+// way it did when the trace was recorded, and side exits back to the
+// interpreter where one doesn't.
+class VM::Trace : public VM::JitAssembler {
+ public:
+  // Each step of a recorded path is an instruction, and the instruction that
+  // followed it.
+  using Path = std::vector<std::pair<const Insn*, const Insn*>>;
+
+  Trace(VM& vm, const Path& path);
+
+  // Runs the trace until it side exits.  Returns the instruction to resume
+  // interpreting from.
+  const Insn* Run(Regs& r, int64_t& steps);
+
+ private:
+  void EmitBranch(int cc, const Insn* target, const Insn* next) override;
+  void EmitGoto(const Insn* target) override;
+  void EmitDynamicGoto() override;
+
+  // A side exit, emitted after the trace.  Null `resume` means the
+  // instruction in rax.
+  struct SideExit {
+    std::size_t label;
+    int64_t steps;
+    const Insn* resume;
+  };
+
+  std::size_t NewSideExit(const Insn* resume);
+
+  std::size_t start_ = 0;
+  const Insn* expected_ = nullptr;  // The recorded successor.
+  std::vector<SideExit> exits_;
+};
+
+VM::Trace::Trace(VM& vm, const Path& path) : JitAssembler(vm) {
+  start_ = NewLabel();
+  Bind(start_);
+  for (const auto& [ip, next] : path) {
+    expected_ = next;
+    EmitInsn(ip);
+  }
+  FlushSteps();
+  EmitJump(start_);
+
+  for (const auto& exit : exits_) {
+    Bind(exit.label);
+    EmitSteps(exit.steps);
+    if (exit.resume) {
+      EmitMovImm(kRax, reinterpret_cast<std::uintptr_t>(exit.resume));
+    }
+    EmitSideExit();
+  }
+
+  Finalize();
+}
+
+const VM::Insn* VM::Trace::Run(Regs& r, int64_t& steps) {
+  State state{r.sp, r.tos, vm_.stack_base_, vm_.stack_limit_, steps, &vm_,
+              nullptr};
+  Enter(state, Address(start_));
+  r = {state.sp, state.tos};
+  steps = state.steps;
+  return state.exit;
+}
+
+// Records a side exit for code emitted here, with the steps not yet counted.
+std::size_t VM::Trace::NewSideExit(const Insn* resume) {
+  exits_.push_back({NewLabel(), pending_steps_, resume});
+  return exits_.back().label;
+}
+
+// Guards that the branch goes the recorded way.
+void VM::Trace::EmitBranch(int cc, const Insn* target, const Insn* next) {
+  if (target == next) {
+    return;
+  }
+  if (expected_ == target) {
+    EmitJcc(cc ^ 1, NewSideExit(next));
+  } else {
+    EmitJcc(cc, NewSideExit(target));
+  }
+}
+
+// The path is already laid out in order.
+void VM::Trace::EmitGoto(const Insn*) {}
+
+// Guards that `C` or `G` went to the recorded destination.
+void VM::Trace::EmitDynamicGoto() {
+  EmitMovImm(kRcx, reinterpret_cast<std::uintptr_t>(expected_));
+  Emit({0x48, 0x39, 0xC8});  // cmp rax, rcx
+  EmitJcc(kCcNe, NewSideExit(nullptr));
+}
+
+// The tracing tier.  This interprets the program, counting how often each
+// backward transfer of control lands on each instruction.  Once a loop head
+// gets hot, it records the path of the next trip around the loop and
+// compiles it to a Trace.  From then on, reaching that loop head runs the
+// trace, until a guard fails and it side exits back to the interpreter.
+class VM::Tracer {
+ public:
+  explicit Tracer(VM& vm)
+      : vm_(vm), hot_(vm.code_.size()), traces_(vm.code_.size()) {}
+
+  // Runs the program from the VM's current PC until it terminates.
+  void Run();
+
+ private:
+  // Trips around a loop before it gets traced.
+  static constexpr int32_t kHotLoop = 50;
+
+  // Trips around a loop before retrying a trace that couldn't be recorded.
+  static constexpr int32_t kRetryDelay = 1000;
+
+  // The longest path to record.
+  static constexpr std::size_t kMaxTrace = 500;
+
+  const Insn* BackEdge(const Insn* head, Regs& r, int64_t& steps);
+  const Insn* Record(const Insn* head, Regs& r, int64_t& steps);
+
+  VM& vm_;
+  std::vector<int32_t> hot_;                   // Trips, per loop head.
+  std::vector<std::unique_ptr<Trace>> traces_;  // Trace, per loop head.
+};
+
+void VM::Tracer::Run() {
+  Regs r = vm_.LoadRegs();
+  const Insn* ip = vm_.At(vm_.pc_);
+  int64_t steps = vm_.steps_;
+
+  for (;;) {
+    const Op op = ip->op;
+    if (op == kOpHalt) {
+      ++steps;
+      vm_.pc_ = ip->next;
+      break;
+    }
+    if (op == kOpStop) {
+      break;
+    }
+    steps += StepsFor(op);
+    const Insn* const next = vm_.Execute(op, ip, r);
+    ip = next <= ip ? BackEdge(next, r, steps) : next;
+  }
+
+  vm_.steps_ = steps;
+  vm_.StoreRegs(r);
+  vm_.terminate_ = true;
+}
+
+// Handles a backward transfer of control to `head`.  Returns where to
+// continue interpreting.
+const VM::Insn* VM::Tracer::BackEdge(const Insn* head, Regs& r,
+                                     int64_t& steps) {
+  const std::size_t index = head - vm_.code_.data();
+  if (const auto& trace = traces_[index]) {
+    return trace->Run(r, steps);
+  }
+  if (++hot_[index] < kHotLoop) {
+    return head;
+  }
+  return Record(head, r, steps);
+}
+
+// Interprets one trip around the loop at `head`, recording its path.  If it
+// gets back to `head`, this compiles the path.  Recording gives up at
+// anything that leaves the loop or starts an inner loop.  Returns where to
+// continue interpreting.
+const VM::Insn* VM::Tracer::Record(const Insn* head, Regs& r,
+                                   int64_t& steps) {
+  const std::size_t index = head - vm_.code_.data();
+  Trace::Path path;
+  const Insn* ip = head;
+
+  for (;;) {
+    const Op op = ip->op;
+    if (op == kOpHalt || op == kOpStop || op == kOpUndefined ||
+        path.size() == kMaxTrace) {
+      break;
+    }
+    steps += StepsFor(op);
+    const Insn* const next = vm_.Execute(op, ip, r);
+    path.emplace_back(ip, next);
+    if (next == head) {
+      auto trace = std::make_unique<Trace>(vm_, path);
+      if (trace->Ok()) {
+        traces_[index] = std::move(trace);
+      } else {
+        hot_[index] = -kRetryDelay;
+      }
+      return head;
+    }
+    ip = next;
+    if (next <= path.back().first) {
+      break;
+    }
+  }
+
+  hot_[index] = -kRetryDelay;
+  return ip;
+}
+
+// Runs the program with the tracing tier.
+bool VM::RunTraced() {
+  if (!tracer_) {
+    tracer_.reset(new Tracer(*this));
+  }
+  tracer_->Run();
+  FlushOutput();
+  return true;
+}
+
+void VM::JitDeleter::operator()(Tracer* tracer) const {
+  delete tracer;
+}
+#else
+bool VM::RunJit() {
+  return false;
+}
+
+bool VM::RunTraced() {
+  return false;
+}
+#endif  // VM_JIT
+
+}  // namespace simplevm::internal
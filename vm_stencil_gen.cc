@@ -0,0 +1,414 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// Extracts the copy-and-patch JIT's stencils from an object file.
+//
+// Building vm_stencils.cc with VM_STENCILS compiles one stencil function per
+// opcode, and a table of them, `VM::kStencilTable`, indexed by opcode.  This
+// reads that object file, an x86-64 ELF relocatable, and writes out
+// vm_stencils.h, which holds each stencil's machine code, and the relocations
+// the JIT patches when it copies a stencil into place.
+//
+// A relocation against a `vm_hole_*` symbol is a hole, which the JIT fills in
+// with an operand or a branch target.  Anything else the stencils refer to
+// in the object file, such as out-of-line functions and constants, goes into
+// a block of shared code that the JIT copies once.  Symbols from outside the
+// object file, such as libm functions, are looked up at run time.
+
+#include <elf.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// These are written out to vm_stencils.h, along with the holes.
+enum RelocType { kAbs64, kPc32, kGotPc32 };
+enum TargetKind { kTargetHole, kTargetShared, kTargetExternal };
+
+const char* const kHoles[] = {
+  "val", "reg", "code", "next", "target", "target1", "succ_insn", "table",
+  "cont1", "cont2", "cont3", "succ",
+};
+
+struct Reloc {
+  std::uint32_t offset;
+  RelocType type;
+  TargetKind kind;
+  std::uint32_t index;    // Hole, shared offset, or external symbol.
+  std::int64_t addend;
+};
+
+[[noreturn]] void Fail(const std::string& msg) {
+  std::cerr << "vm_stencil_gen: " << msg << "\n";
+  std::exit(1);
+}
+
+class Object {
+ public:
+  explicit Object(std::vector<char> file) : file_(std::move(file)) {
+    if (file_.size() < sizeof(Elf64_Ehdr)) {
+      Fail("not an ELF file");
+    }
+    const auto* ehdr = At<Elf64_Ehdr>(0);
+    if (std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_machine != EM_X86_64 || ehdr->e_type != ET_REL) {
+      Fail("not an x86-64 ELF relocatable");
+    }
+    shdr_ = At<Elf64_Shdr>(ehdr->e_shoff);
+    num_sections_ = ehdr->e_shnum;
+    shstrtab_ = Data(ehdr->e_shstrndx);
+
+    for (std::size_t i = 0; i != num_sections_; ++i) {
+      if (shdr_[i].sh_type == SHT_SYMTAB) {
+        syms_ = At<Elf64_Sym>(shdr_[i].sh_offset);
+        num_syms_ = shdr_[i].sh_size / sizeof(Elf64_Sym);
+        strtab_ = Data(shdr_[i].sh_link);
+      } else if (shdr_[i].sh_type == SHT_RELA) {
+        rela_[shdr_[i].sh_info] = i;
+      }
+    }
+    if (!syms_) {
+      Fail("no symbol table");
+    }
+  }
+
+  const Elf64_Shdr& Section(std::size_t i) const { return shdr_[i]; }
+  const char* SectionName(std::size_t i) const {
+    return shstrtab_ + shdr_[i].sh_name;
+  }
+  const char* Data(std::size_t i) const {
+    return file_.data() + shdr_[i].sh_offset;
+  }
+
+  const Elf64_Sym& Sym(std::size_t i) const { return syms_[i]; }
+  std::size_t NumSyms() const { return num_syms_; }
+  const char* SymName(const Elf64_Sym& sym) const {
+    return strtab_ + sym.st_name;
+  }
+
+  // Returns the relocations that apply to section `i`.
+  std::vector<Elf64_Rela> Relocs(std::size_t i) const {
+    const auto it = rela_.find(i);
+    if (it == rela_.end()) {
+      return {};
+    }
+    const auto& rela = shdr_[it->second];
+    const auto* begin = At<Elf64_Rela>(rela.sh_offset);
+    return {begin, begin + rela.sh_size / sizeof(Elf64_Rela)};
+  }
+
+ private:
+  template <typename T>
+  const T* At(std::size_t offset) const {
+    return reinterpret_cast<const T*>(file_.data() + offset);
+  }
+
+  std::vector<char> file_;
+  const Elf64_Shdr* shdr_ = nullptr;
+  std::size_t num_sections_ = 0;
+  const char* shstrtab_ = nullptr;
+  const Elf64_Sym* syms_ = nullptr;
+  std::size_t num_syms_ = 0;
+  const char* strtab_ = nullptr;
+  std::map<std::size_t, std::size_t> rela_;  // Section to its SHT_RELA.
+};
+
+class Generator {
+ public:
+  explicit Generator(const Object& obj) : obj_(obj) {}
+
+  void Run();
+  void Write(std::ostream& out) const;
+
+ private:
+  struct Stencil {
+    std::vector<unsigned char> code;
+    std::vector<Reloc> relocs;
+  };
+
+  std::vector<Reloc> Classify(std::size_t section, bool in_stencil);
+  std::size_t SharedOffset(std::size_t section);
+
+  const Object& obj_;
+  std::map<std::size_t, std::size_t> stencil_sections_;  // Section to op.
+  std::vector<Stencil> stencils_;
+  std::vector<unsigned char> shared_;
+  std::vector<Reloc> shared_relocs_;
+  std::map<std::size_t, std::size_t> shared_offset_;  // Section to offset.
+  std::deque<std::size_t> shared_queue_;
+  std::vector<std::string> externals_;
+  std::map<std::string, std::size_t> external_index_;
+};
+
+void Generator::Run() {
+  // Find the table, and the stencils it points to.
+  const Elf64_Sym* table = nullptr;
+  for (std::size_t i = 0; i != obj_.NumSyms(); ++i) {
+    const auto& sym = obj_.Sym(i);
+    if (ELF64_ST_TYPE(sym.st_info) == STT_OBJECT &&
+        std::strstr(obj_.SymName(sym), "kStencilTable")) {
+      table = &sym;
+    }
+  }
+  if (!table) {
+    Fail("no kStencilTable; was vm_stencils.cc built with VM_STENCILS?");
+  }
+
+  const std::size_t num_ops = table->st_size / sizeof(std::uint64_t);
+  std::vector<std::size_t> sections(num_ops, 0);
+  for (const auto& rela : obj_.Relocs(table->st_shndx)) {
+    const auto offset = rela.r_offset - table->st_value;
+    if (offset >= table->st_size) {
+      continue;
+    }
+    const auto& sym = obj_.Sym(ELF64_R_SYM(rela.r_info));
+    if (ELF64_R_TYPE(rela.r_info) != R_X86_64_64 ||
+        sym.st_value + rela.r_addend != 0) {
+      Fail("stencils must be built with -ffunction-sections");
+    }
+    sections[offset / sizeof(std::uint64_t)] = sym.st_shndx;
+  }
+  for (std::size_t op = 0; op != num_ops; ++op) {
+    if (sections[op] == 0) {
+      Fail("missing stencil for opcode " + std::to_string(op));
+    }
+    if (!stencil_sections_.emplace(sections[op], op).second) {
+      Fail("stencils share code; build with -fno-ipa-icf");
+    }
+  }
+
+  stencils_.resize(num_ops);
+  for (std::size_t op = 0; op != num_ops; ++op) {
+    const auto& shdr = obj_.Section(sections[op]);
+    const auto* data = obj_.Data(sections[op]);
+    stencils_[op].code.assign(data, data + shdr.sh_size);
+    stencils_[op].relocs = Classify(sections[op], true);
+  }
+
+  while (!shared_queue_.empty()) {
+    const auto section = shared_queue_.front();
+    shared_queue_.pop_front();
+    for (auto reloc : Classify(section, false)) {
+      reloc.offset += shared_offset_[section];
+      shared_relocs_.push_back(reloc);
+    }
+  }
+}
+
+// Classifies the relocations for a section.
+std::vector<Reloc> Generator::Classify(std::size_t section, bool in_stencil) {
+  std::vector<Reloc> relocs;
+  for (const auto& rela : obj_.Relocs(section)) {
+    Reloc reloc{std::uint32_t(rela.r_offset), kAbs64, kTargetHole, 0,
+                rela.r_addend};
+    switch (ELF64_R_TYPE(rela.r_info)) {
+      case R_X86_64_64: reloc.type = kAbs64; break;
+      case R_X86_64_PC32: case R_X86_64_PLT32: reloc.type = kPc32; break;
+      case R_X86_64_GOTPCREL: case R_X86_64_GOTPCRELX:
+      case R_X86_64_REX_GOTPCRELX: reloc.type = kGotPc32; break;
+      default: {
+        Fail(std::string("unsupported relocation in ") +
+             obj_.SectionName(section) + ": " +
+             std::to_string(ELF64_R_TYPE(rela.r_info)));
+      }
+    }
+
+    const auto& sym = obj_.Sym(ELF64_R_SYM(rela.r_info));
+    const std::string name = obj_.SymName(sym);
+    if (sym.st_shndx == SHN_UNDEF && name.rfind("vm_hole_", 0) == 0) {
+      if (!in_stencil) {
+        Fail("hole " + name + " outside a stencil");
+      }
+      std::size_t hole = 0;
+      while (hole != std::size(kHoles) && name.substr(8) != kHoles[hole]) {
+        ++hole;
+      }
+      if (hole == std::size(kHoles)) {
+        Fail("unknown hole " + name);
+      }
+      reloc.kind = kTargetHole;
+      reloc.index = hole;
+
+      // Continuations must be tail calls, or the native stack grows with
+      // every instruction.
+      if (name.rfind("vm_hole_cont", 0) == 0 || name == "vm_hole_succ") {
+        const auto* code =
+            reinterpret_cast<const unsigned char*>(obj_.Data(section));
+        const auto at = rela.r_offset;
+        const bool jump = reloc.type == kPc32 && at >= 2 &&
+                          (code[at - 1] == 0xE9 ||
+                           (code[at - 2] == 0x0F &&
+                            (code[at - 1] & 0xF0) == 0x80));
+        if (!jump) {
+          Fail(std::string(obj_.SectionName(section)) + " calls " + name +
+               " rather than tail-calling it");
+        }
+      }
+    } else if (sym.st_shndx == SHN_UNDEF) {
+      auto [it, added] = external_index_.emplace(name, externals_.size());
+      if (added) {
+        externals_.push_back(name);
+      }
+      reloc.kind = kTargetExternal;
+      reloc.index = it->second;
+    } else if (sym.st_shndx >= SHN_LORESERVE) {
+      Fail("unsupported symbol " + name);
+    } else if (stencil_sections_.count(sym.st_shndx)) {
+      Fail(std::string(obj_.SectionName(section)) + " refers to a stencil");
+    } else {
+      reloc.kind = kTargetShared;
+      reloc.index = std::uint32_t(SharedOffset(sym.st_shndx) + sym.st_value);
+    }
+    relocs.push_back(reloc);
+  }
+  return relocs;
+}
+
+// Returns where a section goes in the shared code, adding it if necessary.
+std::size_t Generator::SharedOffset(std::size_t section) {
+  if (auto it = shared_offset_.find(section); it != shared_offset_.end()) {
+    return it->second;
+  }
+  const auto& shdr = obj_.Section(section);
+  if (shdr.sh_type != SHT_PROGBITS || (shdr.sh_flags & SHF_WRITE)) {
+    Fail(std::string("stencils can't refer to writable data in ") +
+         obj_.SectionName(section));
+  }
+  const std::size_t align = std::max<std::size_t>(shdr.sh_addralign, 1);
+  shared_.resize((shared_.size() + align - 1) / align * align, 0xCC);
+  const auto offset = shared_.size();
+  const auto* data = obj_.Data(section);
+  shared_.insert(shared_.end(), data, data + shdr.sh_size);
+  shared_offset_[section] = offset;
+  shared_queue_.push_back(section);
+  return offset;
+}
+
+void WriteBytes(std::ostream& out, const std::vector<unsigned char>& bytes) {
+  for (std::size_t i = 0; i != bytes.size(); ++i) {
+    out << (i % 16 == 0 ? "\n   " : "") << " 0x" << std::hex
+        << int(bytes[i]) << std::dec << ",";
+  }
+  out << "\n";
+}
+
+void WriteRelocs(std::ostream& out, const std::vector<Reloc>& relocs) {
+  static const char* const kTypes[] = {"kAbs64", "kPc32", "kGotPc32"};
+  static const char* const kKinds[] = {
+    "kTargetHole", "kTargetShared", "kTargetExternal"
+  };
+  for (const auto& reloc : relocs) {
+    out << "  {" << reloc.offset << ", " << kTypes[reloc.type] << ", "
+        << kKinds[reloc.kind] << ", " << reloc.index << ", " << reloc.addend
+        << "},\n";
+  }
+  out << "  {},\n";
+}
+
+void Generator::Write(std::ostream& out) const {
+  out << "// Generated from vm_stencils.cc by vm_stencil_gen.  "
+      << "Do not edit.\n\n";
+  out << "namespace vm_stencils {\n\n";
+
+  out << "enum Hole {\n";
+  for (const char* hole : kHoles) {
+    out << "  kHole";
+    for (const char* c = hole; *c; ++c) {
+      if (c == hole || c[-1] == '_') {
+        out << char(std::toupper(*c));
+      } else if (*c != '_') {
+        out << *c;
+      }
+    }
+    out << ",\n";
+  }
+  out << "};\n\n";
+
+  out << "enum RelocType { kAbs64, kPc32, kGotPc32 };\n";
+  out << "enum TargetKind { kTargetHole, kTargetShared, kTargetExternal };\n\n";
+  out << "struct Reloc {\n"
+      << "  std::uint32_t offset;\n"
+      << "  RelocType type;\n"
+      << "  TargetKind kind;\n"
+      << "  std::uint32_t index;\n"
+      << "  std::int64_t addend;\n"
+      << "};\n\n";
+  out << "struct Stencil {\n"
+      << "  const unsigned char* code;\n"
+      << "  std::size_t size;\n"
+      << "  const Reloc* relocs;\n"
+      << "  std::size_t num_relocs;\n"
+      << "};\n\n";
+
+  out << "const unsigned char kShared[] = {";
+  WriteBytes(out, shared_);
+  out << "  0xCC,\n};\n";
+  out << "constexpr std::size_t kSharedSize = " << shared_.size() << ";\n\n";
+
+  out << "const Reloc kSharedRelocs[] = {\n";
+  WriteRelocs(out, shared_relocs_);
+  out << "};\n";
+  out << "constexpr std::size_t kNumSharedRelocs = " << shared_relocs_.size()
+      << ";\n\n";
+
+  out << "const char* const kExternals[] = {\n";
+  for (const auto& name : externals_) {
+    out << "  \"" << name << "\",\n";
+  }
+  out << "  nullptr,\n};\n";
+  out << "constexpr std::size_t kNumExternals = " << externals_.size()
+      << ";\n\n";
+
+  for (std::size_t op = 0; op != stencils_.size(); ++op) {
+    out << "const unsigned char kCode" << op << "[] = {";
+    WriteBytes(out, stencils_[op].code);
+    out << "};\n";
+    out << "const Reloc kRelocs" << op << "[] = {\n";
+    WriteRelocs(out, stencils_[op].relocs);
+    out << "};\n\n";
+  }
+
+  out << "// Indexed by opcode.\n";
+  out << "const Stencil kStencils[] = {\n";
+  for (std::size_t op = 0; op != stencils_.size(); ++op) {
+    out << "  {kCode" << op << ", " << stencils_[op].code.size()
+        << ", kRelocs" << op << ", " << stencils_[op].relocs.size() << "},\n";
+  }
+  out << "};\n\n";
+
+  out << "}  // namespace vm_stencils\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::cerr << "usage: vm_stencil_gen vm_stencils.o > vm_stencils.h\n";
+    return 1;
+  }
+  std::ifstream in(argv[1], std::ios::binary);
+  if (!in) {
+    Fail(std::string("can't read ") + argv[1]);
+  }
+  std::vector<char> file{std::istreambuf_iterator<char>(in),
+                         std::istreambuf_iterator<char>()};
+
+  const Object obj(std::move(file));
+  Generator gen(obj);
+  gen.Run();
+  gen.Write(std::cout);
+  return 0;
+}
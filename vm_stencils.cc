@@ -0,0 +1,88 @@
+// Copyright 2022, Joe Zbiciak <joe.zbiciak@leftturnonly.info>
+// SPDX-License-Identifier:  CC-BY-SA-4.0
+//
+// The copy-and-patch JIT's stencils, one per opcode.  This is only ever
+// built with VM_STENCILS, into vm_stencils.o, for vm_stencil_gen to extract
+// the stencils from.  No program links it.
+
+#include "vm_internal.h"
+
+namespace simplevm::internal {
+
+#if VM_STENCILS
+// Reads a hole: an operand that the copy-and-patch JIT fills in when it
+// copies a stencil.  This is a 64-bit immediate with a relocation against
+// `name`, which the compiler can't see through.
+#define VM_HOLE(name) \
+  ({ std::uint64_t hole_; asm("movabs $" #name ", %0" : "=r"(hole_)); hole_; })
+
+// The stencil for an opcode.  This runs Execute() on an instruction built
+// from holes, so the operands become immediates, and the stencils can't
+// drift from the interpreters.  Execute() returns a pointer relative to the
+// instruction, for the instructions that follow it, which folds to a
+// continuation at compile time.  A branch's target is compared against the
+// one the JIT patches in, and anything else goes through the JIT's table
+// of stencils.
+//
+// The machine state travels in argument registers, as in the tail-call
+// interpreter.  The instruction and registers are scoped to a block, so
+// that the compiler can make the continuations into tail calls.
+template <VM::Op op>
+void VM::Stencil(void* vm_ptr, ValueType* sp, int64_t steps, ValueType tos) {
+  auto* const vm = static_cast<VM*>(vm_ptr);
+  const Insn* next = nullptr;
+  int follows = 0;  // Which of the instructions that follow is next, if any.
+  {
+    Insn insn[2];
+    const std::uint64_t val_bits = VM_HOLE(vm_hole_val);
+    insn[0].op = op;
+    insn[0].reg = ByteType(VM_HOLE(vm_hole_reg));
+    insn[0].code = int(VM_HOLE(vm_hole_code));
+    insn[0].next = LocType(VM_HOLE(vm_hole_next));
+    insn[0].target = LocType(VM_HOLE(vm_hole_target));
+    std::memcpy(&insn[0].val, &val_bits, sizeof(val_bits));
+    insn[1].target = LocType(VM_HOLE(vm_hole_target1));
+
+    Regs r{sp, tos};
+    steps += StepsFor(op);
+    if constexpr (op == kOpHalt || op == kOpStop) {
+      if (op == kOpHalt) {
+        vm->pc_ = insn[0].next;
+      }
+      vm->steps_ = steps;
+      vm->StoreRegs(r);
+      vm->terminate_ = true;
+      return;
+    } else {
+      next = vm->Execute(op, insn, r);
+      sp = r.sp;
+      tos = r.tos;
+      follows = next == insn + 1 ? 1 : next == insn + 2 ? 2
+              : next == insn + 3 ? 3 : 0;
+    }
+  }
+
+  switch (follows) {
+    case 1: return vm_hole_cont1(vm, sp, steps, tos);
+    case 2: return vm_hole_cont2(vm, sp, steps, tos);
+    case 3: return vm_hole_cont3(vm, sp, steps, tos);
+  }
+  if (next == reinterpret_cast<const Insn*>(VM_HOLE(vm_hole_succ_insn))) {
+    return vm_hole_succ(vm, sp, steps, tos);
+  }
+  auto* const table =
+      reinterpret_cast<VmStencilFxn* const*>(VM_HOLE(vm_hole_table));
+  return table[next - vm->code_.data()](vm, sp, steps, tos);
+}
+
+// The stencils, by opcode, for vm_stencil_gen to find.
+[[gnu::used]] VmStencilFxn* const VM::kStencilTable[kNumOps] = {
+  &Stencil<kOpHalt>, &Stencil<kOpStop>,
+#define VM_OPCODE_STENCIL(name) &Stencil<kOp##name>,
+  VM_OPCODES(VM_OPCODE_STENCIL)
+#undef VM_OPCODE_STENCIL
+};
+#undef VM_HOLE
+#endif  // VM_STENCILS
+
+}  // namespace simplevm::internal